@@ -5,11 +5,14 @@
  * Created on February 12, 2016, 6:56 PM
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
@@ -17,9 +20,49 @@
 #include <errorfc.h>
 
 #include "socksserver.h"
+#include "sockstrace.h"
+#include "sockslog.h"
+#include "sockspool.h"
+#include "socksbreaker.h"
+#include "socksauth.h"
+#include "sockstune.h"
+
+#define MAX_WORKERS 256
+
+#define POOL_MAX_PER_DEST 4
+#define POOL_MAX_AGE_MS 10000
+
+#define BREAKER_OPEN_MS 1000
+#define BREAKER_MAX_OPEN_MS 60000
+#define BREAKER_SLOW_MS 5000
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    socks_server_lowlatency_t ll;
+    int lowlatency;
+    socks_server_t socks_server4, socks_server6;
+    int s4, s6;
+    sockspool_t* pool;
+    socksbreaker_t* breaker;
+} worker_t;
 
 static volatile int stopping = 0;
 
+static int port = 1080;
+static int n_workers = 1;
+static int lowlatency_usec = 0;
+static int cpus[MAX_WORKERS];
+static int n_cpus = 0;
+static const char* tls_cert = NULL;
+static const char* tls_key = NULL;
+static int ktls = 0;
+static int sockmap = 0;
+static int pool_sockets = 0;
+static int breaker_failures = 0;
+static socksauth_t* auth = NULL;
+static sockstune_t* tune = NULL;
+
 static void sig(int signo) {
     if (signo == SIGTERM || signo == SIGINT) {
         stopping = 1;
@@ -27,20 +70,369 @@ static void sig(int signo) {
     }
 }
 
+/**
+ * SIGHUP reloads the credential file, the signal is blocked in every
+ * other thread. At shutdown main sends it one more SIGHUP to return
+ * before the store is closed.
+ */
+static void* run_reloader(void* arg) {
+    sigset_t* hup = arg;
+    int signo;
+    
+    while (sigwait(hup, &signo) == 0 && !stopping) {
+        if (socksauth_reload(auth)) {
+            slogf(SLOG_INFO, "Credentials reloaded\n");
+        } else {
+            slogf(SLOG_WARN, "Credentials not reloaded, keeping the previous ones\n");
+        }
+    }
+    
+    return NULL;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-v] [-q] [-R trace_prefix] [-p port] [-w workers] [-L usec] [-C cpulist | -N iface] [-c cert -k key [-K]] [-M] [-P sockets] [-A file] [-T file] [-B failures]\n"
+            "  -v          more verbose logging, repeat for debug messages\n"
+            "  -q          log errors only\n"
+            "  -R prefix   record connection traces to prefix.<tid> (see sockstrace-dump)\n"
+            "  -p port     listen port, 1080 by default\n"
+            "  -w workers  number of event loop threads sharing the port\n"
+            "  -L usec     low-latency mode: SO_BUSY_POLL and loop spinning for usec\n"
+            "  -C cpulist  pin workers to these cores, e.g. 2-5,8\n"
+            "  -N iface    pin workers to the cores of iface's NUMA node\n"
+            "  -c cert     serve TLS with this certificate (chain) file\n"
+            "  -k key      private key for -c\n"
+            "  -K          encrypt TLS records in the kernel (kTLS) when supported\n"
+            "  -M          relay established tunnels in the kernel (BPF sockmap) when supported, not with -c\n"
+            "  -P sockets  keep up to this many connections per worker pre-connected to hot destinations\n"
+            "  -A file     require username/password auth, user:$y$... or user:$6$... crypt(3) lines, SIGHUP reloads\n"
+            "  -T file     socket tuning profiles and the rules selecting them (see sockstune.h)\n"
+            "  -B failures refuse destinations for a backoff after this many connect failures in a row\n",
+            argv0);
+}
+
+/**
+ * Parses a kernel style cpu list ("0-3,8") into cpus, returns the count.
+ */
+static int parse_cpulist(const char* list, int* out, int max) {
+    int n = 0;
+    const char* p = list;
+    
+    while (*p != 0 && *p != '\n') {
+        char* end;
+        long from = strtol(p, &end, 10);
+        long to = from;
+    
+        if (end == p || from < 0) {
+            return -1;
+        }
+        p = end;
+    
+        if (*p == '-') {
+            p++;
+            to = strtol(p, &end, 10);
+            if (end == p || to < from) {
+                return -1;
+            }
+            p = end;
+        }
+    
+        for (long c = from; c <= to && n < max; c++) {
+            out[n++] = c;
+        }
+    
+        if (*p == ',') {
+            p++;
+        }
+    }
+    
+    return n;
+}
+
+/**
+ * Reads the cores of the NUMA node the network interface is attached to.
+ */
+static int numa_cpus_for_iface(const char* iface, int* out, int max) {
+    char path[256];
+    char line[1024];
+    FILE* f;
+    int node = -1;
+    
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", iface);
+    if ((f = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fscanf(f, "%d", &node) != 1) {
+        node = -1;
+    }
+    fclose(f);
+    
+    if (node < 0) {
+        node = 0; // no NUMA information, single node machine
+    }
+    
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ((f = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fgets(line, sizeof(line), f) == NULL) {
+        line[0] = 0;
+    }
+    fclose(f);
+    
+    return parse_cpulist(line, out, max);
+}
+
 static int my_socks_server_peerfilter(void *closure, struct sockaddr * addr, socklen_t addr_len) {
     return 1;
 }
 
+static void* run_worker(void* arg) {
+    worker_t* w = arg;
+    socks_server_t* servers[2];
+    int n_servers = 0;
+    
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+    
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(port);
+    
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr = in6addr_any;
+    sin6.sin6_port = htons(port);
+    
+    int flags = n_workers > 1 ? SOCKS_SERVER_REUSEPORT : 0;
+    
+    w->s4 = socks_server_start_ex(&w->socks_server4, (struct sockaddr *)&sin, sizeof(sin), flags);
+    w->s6 = socks_server_start_ex(&w->socks_server6, (struct sockaddr *)&sin6, sizeof(sin6), flags);
+    
+    if (tls_cert != NULL) {
+        if (w->s4 && !socks_server_set_tls(&w->socks_server4, tls_cert, tls_key)) {
+            socks_server_cleanup(&w->socks_server4);
+            w->s4 = 0;
+        }
+        if (w->s6 && !socks_server_set_tls(&w->socks_server6, tls_cert, tls_key)) {
+            socks_server_cleanup(&w->socks_server6);
+            w->s6 = 0;
+        }
+    
+        if (ktls) {
+            if (w->s4) {
+                socks_server_enable_ktls(&w->socks_server4);
+            }
+            if (w->s6) {
+                socks_server_enable_ktls(&w->socks_server6);
+            }
+        }
+    }
+    
+    if (w->s4) {
+        w->socks_server4.peer_filter = my_socks_server_peerfilter;
+        servers[n_servers++] = &w->socks_server4;
+    }
+    if (w->s6) {
+        w->socks_server6.peer_filter = my_socks_server_peerfilter;
+        servers[n_servers++] = &w->socks_server6;
+    }
+    
+    if (sockmap) {
+        for (int i = 0; i < n_servers; i++) {
+            if (!socks_server_enable_sockmap(servers[i])) {
+                slogf(SLOG_WARN, "sockmap not supported, relaying in user space\n");
+                break;
+            }
+        }
+    }
+    
+    if (pool_sockets > 0 && n_servers > 0) {
+        sockspool_config_t pc = { pool_sockets, POOL_MAX_PER_DEST, POOL_MAX_AGE_MS };
+    
+        if ((w->pool = sockspool_new(&pc)) != NULL) {
+            for (int i = 0; i < n_servers; i++) {
+                socks_server_set_pool(servers[i], w->pool);
+            }
+        }
+    }
+    
+    if (breaker_failures > 0 && n_servers > 0) {
+        socksbreaker_config_t bc = { breaker_failures, BREAKER_OPEN_MS, BREAKER_MAX_OPEN_MS, BREAKER_SLOW_MS };
+    
+        if ((w->breaker = socksbreaker_new(&bc)) != NULL) {
+            for (int i = 0; i < n_servers; i++) {
+                socks_server_set_breaker(servers[i], w->breaker);
+            }
+        }
+    }
+    
+    if (auth != NULL) {
+        for (int i = 0; i < n_servers; i++) {
+            socks_server_set_auth(servers[i], auth);
+        }
+    }
+    
+    if (tune != NULL) {
+        for (int i = 0; i < n_servers; i++) {
+            socks_server_set_tuning(servers[i], tune, NULL);
+        }
+    }
+    
+    if (w->lowlatency) {
+        for (int i = 0; i < n_servers; i++) {
+            socks_server_set_lowlatency(servers[i], &w->ll);
+        }
+    }
+    
+    if (n_servers > 0) {
+        if (w->index == 0) {
+            printf("Socks server started\n");
+        }
+    
+        while (!stopping) {
+            socks_server_periodic_multi(servers, n_servers, 10);
+        }
+    
+        for (int i = 0; i < n_servers; i++) {
+            slogf(SLOG_INFO, "worker %d: %llu spin wakeups, %llu sleep wakeups, %llu tunnels offloaded\n", w->index,
+                    (unsigned long long)servers[i]->spin_wakeups, (unsigned long long)servers[i]->sleep_wakeups,
+                    (unsigned long long)servers[i]->sockmap_links);
+            slogf(SLOG_INFO, "worker %d: max relay wait %.3f ms, %llu turns preempted by the quota\n", w->index,
+                    servers[i]->sched_max_wait_usec / 1e3, (unsigned long long)servers[i]->sched_preemptions);
+            socks_server_cleanup(servers[i]);
+        }
+    
+        if (w->pool != NULL) {
+            sockspool_stats_t st;
+    
+            sockspool_stats(w->pool, &st);
+            slogf(SLOG_INFO, "worker %d: pool hits %llu, misses %llu (%.1f%% hit rate), opened %llu, wasted %llu expired + %llu failed\n", w->index,
+                    (unsigned long long)st.hits, (unsigned long long)st.misses,
+                    st.hits + st.misses > 0 ? 100.0 * st.hits / (st.hits + st.misses) : 0.0,
+                    (unsigned long long)st.opened, (unsigned long long)st.expired, (unsigned long long)st.failed);
+            sockspool_free(w->pool);
+        }
+    
+        if (w->breaker != NULL) {
+            socksbreaker_stats_t st;
+    
+            socksbreaker_stats(w->breaker, &st);
+            slogf(SLOG_INFO, "worker %d: breaker rejected %llu requests, %llu circuits opened, %llu closed by a probe, %d open\n", w->index,
+                    (unsigned long long)st.rejected, (unsigned long long)st.opened, (unsigned long long)st.closed, st.open);
+            socksbreaker_free(w->breaker);
+        }
+    }
+    
+    return NULL;
+}
+
 /*
  * 
  */
 int main(int argc, char** argv) {
-
+    
+    /* options */
+    
+    const char* numa_iface = NULL;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "vqR:p:w:L:C:N:c:k:KMP:A:T:B:")) != -1) {
+        switch (opt) {
+            case 'v':
+                socks_log_level++;
+                break;
+            case 'q':
+                socks_log_level = SLOG_ERROR;
+                break;
+            case 'R':
+                if (!sockstrace_open(optarg, 0)) {
+                    fprintf(stderr, "Bad trace prefix: %s\n", optarg);
+                    return (EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'w':
+                n_workers = atoi(optarg);
+                break;
+            case 'L':
+                lowlatency_usec = atoi(optarg);
+                break;
+            case 'C':
+                n_cpus = parse_cpulist(optarg, cpus, MAX_WORKERS);
+                if (n_cpus <= 0) {
+                    fprintf(stderr, "Bad cpu list: %s\n", optarg);
+                    return (EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                numa_iface = optarg;
+                break;
+            case 'c':
+                tls_cert = optarg;
+                break;
+            case 'k':
+                tls_key = optarg;
+                break;
+            case 'K':
+                ktls = 1;
+                break;
+            case 'M':
+                sockmap = 1;
+                break;
+            case 'P':
+                pool_sockets = atoi(optarg);
+                break;
+            case 'B':
+                breaker_failures = atoi(optarg);
+                break;
+            case 'A':
+                if ((auth = socksauth_open(optarg)) == NULL) {
+                    fprintf(stderr, "Bad credential file: %s\n", optarg);
+                    return (EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                if ((tune = sockstune_open(optarg)) == NULL) {
+                    fprintf(stderr, "Bad tuning file: %s\n", optarg);
+                    return (EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return (EXIT_FAILURE);
+        }
+    }
+    
+    if (port <= 0 || port > 65535 || n_workers < 1 || n_workers > MAX_WORKERS || (tls_cert == NULL) != (tls_key == NULL)
+            || (ktls && tls_cert == NULL)) {
+        usage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+    
+    if (sockmap && tls_cert != NULL) {
+        fprintf(stderr, "TLS tunnels are relayed in user space, -M has no effect with -c\n");
+        sockmap = 0;
+    }
+    
+    if (numa_iface != NULL && n_cpus == 0) {
+        n_cpus = numa_cpus_for_iface(numa_iface, cpus, MAX_WORKERS);
+        if (n_cpus <= 0) {
+            fprintf(stderr, "No NUMA cores found for %s\n", numa_iface);
+            return (EXIT_FAILURE);
+        }
+    }
+    
     /* initialize signals */
     
     struct sigaction sa;
     sigset_t ss;
-
+    
     WARN_IFM1(sigemptyset(&ss));
     sa.sa_handler = sig;
     sa.sa_mask = ss;
@@ -53,60 +445,89 @@ int main(int argc, char** argv) {
     sa.sa_flags = 0;
     WARN_IFM1(sigaction(SIGINT, &sa, NULL));
     
-    /* main loop */
+    static sigset_t hup;
+    pthread_t reloader = 0;
     
-    socks_server_t socks_server4, socks_server6;
-    struct sockaddr_in sin;
-    struct sockaddr_in6 sin6;
-
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = INADDR_ANY;
-    sin.sin_port = htons(1080);
-
-    memset(&sin6, 0, sizeof(sin6));
-    sin6.sin6_family = AF_INET6;
-    sin6.sin6_addr = in6addr_any;
-    sin6.sin6_port = htons(1080);
+    if (auth != NULL) {
+        WARN_IFM1(sigemptyset(&hup));
+        WARN_IFM1(sigaddset(&hup, SIGHUP));
+        pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    
+        if (pthread_create(&reloader, NULL, run_reloader, &hup) != 0) {
+            fprintf(stderr, "Reload thread not started, SIGHUP terminates\n");
+            pthread_sigmask(SIG_UNBLOCK, &hup, NULL);
+            reloader = 0;
+        }
+    }
+    
+    /* main loop */
     
     set_debug_stream(stderr);
     
-    int s4 = socks_server_start(&socks_server4, (struct sockaddr *)&sin, sizeof(sin));
-    int s6 = socks_server_start(&socks_server6, (struct sockaddr *)&sin6, sizeof(sin6));
+    if (!socks_log_start(stderr)) {
+        fprintf(stderr, "Logging thread not started, logging synchronously\n");
+    }
     
-    if (s4) {
-        socks_server4.peer_filter = my_socks_server_peerfilter;
+    worker_t* workers = calloc(n_workers, sizeof(worker_t));
+    
+    for (int i = 0; i < n_workers; i++) {
+        workers[i].index = i;
+        workers[i].lowlatency = lowlatency_usec > 0 || n_cpus > 0;
+        workers[i].ll.cpu = n_cpus > 0 ? cpus[i % n_cpus] : -1;
+        workers[i].ll.busy_poll_usec = lowlatency_usec;
+        workers[i].ll.spin_usec = lowlatency_usec;
     }
-    if (s6) {
-        socks_server6.peer_filter = my_socks_server_peerfilter;
+    
+    // extra workers leave signal handling to the main thread
+    sigset_t all, old;
+    WARN_IFM1(sigfillset(&all));
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 1; i < n_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Worker %d not started\n", i);
+            workers[i].thread = 0;
+        }
     }
-
-    if (s4 || s6) {
-        printf("Socks server started\n");
-        
-        while (!stopping) {
-            if (s4) {
-                socks_server_periodic(&socks_server4, 10);
-            }
-            if (s6) {
-                socks_server_periodic(&socks_server6, 10);
-            }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    run_worker(&workers[0]);
+    
+    stopping = 1;
+    for (int i = 1; i < n_workers; i++) {
+        if (workers[i].thread) {
+            pthread_join(workers[i].thread, NULL);
         }
-        
-        if (s4)
-            socks_server_cleanup(&socks_server4);
-        if (s6)
-            socks_server_cleanup(&socks_server6);
-        
+    }
+    
+    if (workers[0].s4 || workers[0].s6) {
         printf("Socks server stopped\n");
     }
     
+    free(workers);
+    
+    // a reload must not run into socksauth_close()
+    if (reloader) {
+        pthread_kill(reloader, SIGHUP);
+        pthread_join(reloader, NULL);
+    }
+    
+    if (auth != NULL) {
+        for (socksauth_user_t* u = socksauth_users(auth); u != NULL; u = u->next) {
+            slogf(SLOG_INFO, "user %s: %llu connections, %llu bytes up, %llu bytes down\n", u->name,
+                    (unsigned long long)u->connections, (unsigned long long)u->bytes_up, (unsigned long long)u->bytes_down);
+        }
+        socksauth_close(auth);
+    }
+    
+    sockstune_close(tune);
+    
+    socks_log_stop();
+    
 //    void* ptr = rcalloc(10);
 //    rcincrease(ptr);
 //
 //    rcdecrease(ptr, NULL);
 //    rcdecrease(ptr, NULL);
-
+    
     return (EXIT_SUCCESS);
 }
-
@@ -0,0 +1,840 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <crypt.h>
+#include <sys/random.h>
+
+#include "socksauth.h"
+#include "sockslog.h"
+
+#define AUTH_NAME_MAX 255
+#define AUTH_PASS_MAX 255
+
+#define DIGEST_SIZE 32
+
+/**
+ * helper threads running crypt_r(), checks allowed to wait for them
+ * (more fail at once) and rejected passwords remembered
+ */
+#define AUTH_THREADS 2
+#define AUTH_QUEUE_MAX 256
+#define AUTH_REJECTED_SLOTS 1024
+
+typedef struct {
+    socksauth_user_t* user;
+    
+    /**
+     * keyed digest of the name, see socksauth.key
+     */
+    uint8_t name[DIGEST_SIZE];
+    
+    /**
+     * crypt(3) hash, or NULL and the SHA-256 of the password
+     */
+    char* crypted;
+    uint8_t digest[DIGEST_SIZE];
+    
+    /**
+     * keyed digest of the last password crypt_r() accepted, so a user's
+     * later logins skip the slow hash; guarded by socksauth.cache_lock
+     */
+    uint8_t verified[DIGEST_SIZE];
+    int has_verified;
+} auth_slot_t;
+
+/**
+ * Open addressing table keyed by name digest, immutable once published
+ * (but for the verified cache).
+ */
+typedef struct {
+    size_t mask;
+    auth_slot_t* slots;
+    
+    /**
+     * unknown users are checked against this crypt(3) hash so that they
+     * take as long as known ones, NULL without crypt entries
+     */
+    char* dummy;
+} auth_table_t;
+
+/**
+ * A crypt(3) check handed to the helper threads; owned by the queue while
+ * it waits or runs, then by the caller until socksauth_check_done().
+ */
+struct socksauth_check {
+    uint8_t name[DIGEST_SIZE];
+    uint8_t keyed[DIGEST_SIZE];
+    uint8_t rejected[DIGEST_SIZE];
+    
+    /**
+     * copy of the hash, the table may be reloaded meanwhile; user is NULL
+     * for unknown users, checked against the dummy hash
+     */
+    char* setting;
+    socksauth_user_t* user;
+    unsigned generation;
+    char plain[AUTH_PASS_MAX + 1];
+    
+    void (*notify)(void* arg);
+    void* notify_arg;
+    
+    int done;
+    int abandoned;
+    int ok;
+    socksauth_check_t* next;
+};
+
+struct socksauth {
+    char* path;
+    
+    /**
+     * random key for the name and cache digests: lookups reveal nothing
+     * about the names compared against
+     */
+    uint8_t key[DIGEST_SIZE];
+    
+    /**
+     * readers hold the lock for a lookup and verification, reload swaps
+     * the pointer
+     */
+    pthread_rwlock_t lock;
+    auth_table_t* table;
+    
+    pthread_mutex_t cache_lock;
+    
+    /**
+     * keyed digests of rejected user / password pairs, so a repeated
+     * wrong password costs no crypt_r(); guarded by cache_lock and
+     * cleared by reloads, which bump the generation
+     */
+    uint8_t rejected[AUTH_REJECTED_SLOTS][DIGEST_SIZE];
+    unsigned generation;
+    
+    /**
+     * checks waiting for the helper threads, FIFO
+     */
+    pthread_mutex_t work_lock;
+    pthread_cond_t work_cond;
+    socksauth_check_t* work_head;
+    socksauth_check_t** work_tail;
+    int work_queued;
+    int work_stop;
+    pthread_t threads[AUTH_THREADS];
+    int n_threads;
+    
+    /**
+     * serializes reloads, guards the identity list
+     */
+    pthread_mutex_t reload_lock;
+    socksauth_user_t* users;
+};
+
+/*
+ * SHA-256 (FIPS 180-4)
+ */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t h[8], const uint8_t* p) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, k;
+    int i;
+    
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+    
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256(const void* data, size_t len, uint8_t out[DIGEST_SIZE]) {
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    const uint8_t* p = data;
+    uint8_t tail[128];
+    size_t rem = len;
+    
+    while (rem >= 64) {
+        sha256_block(h, p);
+        p += 64;
+        rem -= 64;
+    }
+    
+    size_t tail_len = rem < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, p, rem);
+    tail[rem] = 0x80;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = bits >> (i * 8);
+    }
+    
+    sha256_block(h, tail);
+    if (tail_len == 128) {
+        sha256_block(h, tail + 64);
+    }
+    
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = h[i] >> 24;
+        out[i * 4 + 1] = h[i] >> 16;
+        out[i * 4 + 2] = h[i] >> 8;
+        out[i * 4 + 3] = h[i];
+    }
+}
+
+/*
+ * Table
+ */
+
+static void keyed_digest(socksauth_t* a, const char* data, size_t len, uint8_t out[DIGEST_SIZE]) {
+    uint8_t buf[DIGEST_SIZE + AUTH_PASS_MAX];
+    
+    memcpy(buf, a->key, DIGEST_SIZE);
+    memcpy(buf + DIGEST_SIZE, data, len);
+    sha256(buf, DIGEST_SIZE + len, out);
+    
+    memset(buf, 0, sizeof(buf));
+}
+
+static int digest_equal(const uint8_t* x, const uint8_t* y) {
+    uint8_t diff = 0;
+    
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        diff |= x[i] ^ y[i];
+    }
+    
+    return diff == 0;
+}
+
+static auth_slot_t* table_find(auth_table_t* t, const uint8_t name[DIGEST_SIZE]) {
+    uint32_t hash = (uint32_t)name[0] | (uint32_t)name[1] << 8 | (uint32_t)name[2] << 16 | (uint32_t)name[3] << 24;
+    
+    for (size_t i = hash & t->mask;; i = (i + 1) & t->mask) {
+        auth_slot_t* slot = &t->slots[i];
+    
+        if (slot->user == NULL || memcmp(slot->name, name, DIGEST_SIZE) == 0) {
+            return slot;
+        }
+    }
+}
+
+static void table_free(auth_table_t* t) {
+    if (t != NULL) {
+        for (size_t i = 0; t->slots != NULL && i <= t->mask; i++) {
+            free(t->slots[i].crypted);
+        }
+        free(t->slots);
+        free(t->dummy);
+        free(t);
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int hex_digest(const char* hex, uint8_t out[DIGEST_SIZE]) {
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        int hi = hex_value(hex[i * 2]);
+        int lo = hi >= 0 ? hex_value(hex[i * 2 + 1]) : -1;
+    
+        if (lo < 0) {
+            return 0;
+        }
+        out[i] = hi << 4 | lo;
+    }
+    
+    return hex[DIGEST_SIZE * 2] == 0;
+}
+
+/**
+ * Accepts the crypt(3) hashes libcrypt can check, e.g. $y$ (yescrypt),
+ * $2b$ (bcrypt) or $6$ (SHA-512).
+ */
+static int crypt_supported(const char* hash) {
+    static __thread struct crypt_data cd;
+    const char* r = crypt_r("", hash, &cd);
+    
+    return r != NULL && r[0] != '*' && strlen(r) == strlen(hash);
+}
+
+/**
+ * Identities are kept for the lifetime of the store; must hold
+ * reload_lock.
+ */
+static socksauth_user_t* user_intern(socksauth_t* a, const char* name) {
+    socksauth_user_t* u;
+    
+    for (u = a->users; u != NULL; u = u->next) {
+        if (strcmp(u->name, name) == 0) {
+            return u;
+        }
+    }
+    
+    if ((u = calloc(1, sizeof(socksauth_user_t))) == NULL || (u->name = strdup(name)) == NULL) {
+        free(u);
+        return NULL;
+    }
+    
+    u->next = a->users;
+    a->users = u;
+    
+    return u;
+}
+
+static auth_table_t* table_load(socksauth_t* a) {
+    FILE* f = fopen(a->path, "r");
+    auth_table_t* t = NULL;
+    char line[AUTH_NAME_MAX + AUTH_PASS_MAX + 16];
+    size_t n_lines = 0, cap = 16;
+    int lineno = 0;
+    int n_weak = 0;
+    
+    if (f == NULL) {
+        slogf(SLOG_ERROR, "%s: %s\n", a->path, strerror(errno));
+        return NULL;
+    }
+    
+    while (fgets(line, sizeof(line), f) != NULL) {
+        n_lines++;
+    }
+    while (cap < n_lines * 2) {
+        cap *= 2;
+    }
+    rewind(f);
+    
+    if ((t = calloc(1, sizeof(auth_table_t))) == NULL || (t->slots = calloc(cap, sizeof(auth_slot_t))) == NULL) {
+        goto fail;
+    }
+    t->mask = cap - 1;
+    
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* sep;
+        char* pass;
+        uint8_t name[DIGEST_SIZE];
+        size_t len = strcspn(line, "\r\n");
+    
+        lineno++;
+        line[len] = 0;
+    
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+    
+        if ((sep = strchr(line, ':')) == NULL || sep == line || sep - line > AUTH_NAME_MAX || strlen(sep + 1) > AUTH_PASS_MAX) {
+            slogf(SLOG_ERROR, "%s:%d: expected user:password\n", a->path, lineno);
+            goto fail;
+        }
+        *sep = 0;
+        pass = sep + 1;
+    
+        keyed_digest(a, line, sep - line, name);
+    
+        auth_slot_t* slot = table_find(t, name);
+    
+        if (slot->user != NULL) {
+            slogf(SLOG_ERROR, "%s:%d: duplicate user %s\n", a->path, lineno, line);
+            goto fail;
+        }
+    
+        if (pass[0] == '$') {
+            if (!crypt_supported(pass)) {
+                slogf(SLOG_ERROR, "%s:%d: unsupported crypt(3) hash\n", a->path, lineno);
+                goto fail;
+            }
+            if ((slot->crypted = strdup(pass)) == NULL || (t->dummy == NULL && (t->dummy = strdup(pass)) == NULL)) {
+                goto fail;
+            }
+        } else if (strncmp(pass, "{SHA256}", 8) == 0) {
+            if (!hex_digest(pass + 8, slot->digest)) {
+                slogf(SLOG_ERROR, "%s:%d: bad SHA256 digest\n", a->path, lineno);
+                goto fail;
+            }
+            n_weak++;
+        } else {
+            sha256(pass, strlen(pass), slot->digest);
+            n_weak++;
+        }
+    
+        if ((slot->user = user_intern(a, line)) == NULL) {
+            goto fail;
+        }
+        memcpy(slot->name, name, DIGEST_SIZE);
+    }
+    
+    if (n_weak > 0) {
+        slogf(SLOG_WARN, "%s: %d plaintext or unsalted {SHA256} entries, use crypt(3) hashes outside of tests\n", a->path, n_weak);
+    }
+    
+    // passwords were on the stack
+    memset(line, 0, sizeof(line));
+    fclose(f);
+    
+    return t;
+    
+    fail:
+    
+    memset(line, 0, sizeof(line));
+    fclose(f);
+    table_free(t);
+    
+    return NULL;
+}
+
+static void check_free(socksauth_check_t* c) {
+    free(c->setting);
+    memset(c, 0, sizeof(socksauth_check_t));
+    free(c);
+}
+
+/**
+ * Negative cache key: the name digest and the password, keyed.
+ */
+static void rejected_digest(socksauth_t* a, const uint8_t name[DIGEST_SIZE], const char* pass, size_t pass_len, uint8_t out[DIGEST_SIZE]) {
+    uint8_t buf[DIGEST_SIZE * 2 + AUTH_PASS_MAX];
+    
+    memcpy(buf, a->key, DIGEST_SIZE);
+    memcpy(buf + DIGEST_SIZE, name, DIGEST_SIZE);
+    memcpy(buf + DIGEST_SIZE * 2, pass, pass_len);
+    sha256(buf, DIGEST_SIZE * 2 + pass_len, out);
+    
+    memset(buf, 0, sizeof(buf));
+}
+
+static uint8_t* rejected_slot(socksauth_t* a, const uint8_t digest[DIGEST_SIZE]) {
+    return a->rejected[((uint32_t)digest[0] | (uint32_t)digest[1] << 8) % AUTH_REJECTED_SLOTS];
+}
+
+/**
+ * The slow part, on a helper thread: crypt_r() against the copied hash,
+ * then the verified or the rejected cache is updated.
+ */
+static void check_crypted(socksauth_t* a, socksauth_check_t* c) {
+    static __thread struct crypt_data cd;
+    const char* r = crypt_r(c->plain, c->setting, &cd);
+    size_t len = strlen(c->setting);
+    uint8_t diff = r == NULL || strlen(r) != len;
+    
+    for (size_t i = 0; r != NULL && i < len && r[i] != 0; i++) {
+        diff |= r[i] ^ c->setting[i];
+    }
+    
+    c->ok = c->user != NULL && diff == 0;
+    
+    memset(c->plain, 0, sizeof(c->plain));
+    memset(&cd, 0, sizeof(cd));
+    
+    if (c->ok) {
+        pthread_rwlock_rdlock(&a->lock);
+    
+        auth_slot_t* slot = table_find(a->table, c->name);
+    
+        // unless a reload changed the password meanwhile
+        if (slot->user != NULL && slot->crypted != NULL && strcmp(slot->crypted, c->setting) == 0) {
+            pthread_mutex_lock(&a->cache_lock);
+            memcpy(slot->verified, c->keyed, DIGEST_SIZE);
+            slot->has_verified = 1;
+            pthread_mutex_unlock(&a->cache_lock);
+        }
+    
+        pthread_rwlock_unlock(&a->lock);
+    } else {
+        pthread_mutex_lock(&a->cache_lock);
+        if (c->generation == a->generation) {
+            memcpy(rejected_slot(a, c->rejected), c->rejected, DIGEST_SIZE);
+        }
+        pthread_mutex_unlock(&a->cache_lock);
+    }
+}
+
+static void* run_checks(void* arg) {
+    socksauth_t* a = arg;
+    
+    pthread_mutex_lock(&a->work_lock);
+    
+    while (!a->work_stop) {
+        socksauth_check_t* c = a->work_head;
+    
+        if (c == NULL) {
+            pthread_cond_wait(&a->work_cond, &a->work_lock);
+            continue;
+        }
+    
+        if ((a->work_head = c->next) == NULL) {
+            a->work_tail = &a->work_head;
+        }
+    
+        // nobody waits for an abandoned check, it is not worth a crypt
+        if (!c->abandoned) {
+            pthread_mutex_unlock(&a->work_lock);
+            check_crypted(a, c);
+            pthread_mutex_lock(&a->work_lock);
+        }
+    
+        void (*notify)(void*) = c->notify;
+        void* notify_arg = c->notify_arg;
+    
+        a->work_queued--;
+        c->done = 1;
+        if (c->abandoned) {
+            check_free(c);
+        }
+    
+        if (notify != NULL) {
+            pthread_mutex_unlock(&a->work_lock);
+            notify(notify_arg);
+            pthread_mutex_lock(&a->work_lock);
+        }
+    }
+    
+    pthread_mutex_unlock(&a->work_lock);
+    
+    return NULL;
+}
+
+socksauth_t* socksauth_open(const char* path) {
+    socksauth_t* a = calloc(1, sizeof(socksauth_t));
+    
+    if (a == NULL || (a->path = strdup(path)) == NULL) {
+        free(a);
+        return NULL;
+    }
+    
+    if (getrandom(a->key, sizeof(a->key), 0) != sizeof(a->key)) {
+        slogf(SLOG_ERROR, "getrandom: %s\n", strerror(errno));
+        free(a->path);
+        free(a);
+        return NULL;
+    }
+    
+    pthread_rwlock_init(&a->lock, NULL);
+    pthread_mutex_init(&a->cache_lock, NULL);
+    pthread_mutex_init(&a->reload_lock, NULL);
+    pthread_mutex_init(&a->work_lock, NULL);
+    pthread_cond_init(&a->work_cond, NULL);
+    a->work_tail = &a->work_head;
+    
+    if (!socksauth_reload(a)) {
+        socksauth_close(a);
+        return NULL;
+    }
+    
+    // signals are left to the threads of the application
+    sigset_t all, old;
+    
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    while (a->n_threads < AUTH_THREADS && pthread_create(&a->threads[a->n_threads], NULL, run_checks, a) == 0) {
+        a->n_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (a->n_threads == 0) {
+        slogf(SLOG_ERROR, "Credential check thread not started\n");
+        socksauth_close(a);
+        return NULL;
+    }
+    
+    return a;
+}
+
+void socksauth_close(socksauth_t* a) {
+    if (a == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&a->work_lock);
+    a->work_stop = 1;
+    pthread_cond_broadcast(&a->work_cond);
+    pthread_mutex_unlock(&a->work_lock);
+    
+    for (int i = 0; i < a->n_threads; i++) {
+        pthread_join(a->threads[i], NULL);
+    }
+    
+    // the servers are gone, what is left only owes its notification
+    while (a->work_head != NULL) {
+        socksauth_check_t* c = a->work_head;
+    
+        a->work_head = c->next;
+        if (c->notify != NULL) {
+            c->notify(c->notify_arg);
+        }
+        check_free(c);
+    }
+    
+    table_free(a->table);
+    
+    while (a->users != NULL) {
+        socksauth_user_t* u = a->users;
+    
+        a->users = u->next;
+        free((char*)u->name);
+        free(u);
+    }
+    
+    pthread_rwlock_destroy(&a->lock);
+    pthread_mutex_destroy(&a->cache_lock);
+    pthread_mutex_destroy(&a->reload_lock);
+    pthread_mutex_destroy(&a->work_lock);
+    pthread_cond_destroy(&a->work_cond);
+    free(a->path);
+    free(a);
+}
+
+int socksauth_reload(socksauth_t* a) {
+    pthread_mutex_lock(&a->reload_lock);
+    
+    auth_table_t* t = table_load(a);
+    auth_table_t* old = NULL;
+    
+    if (t != NULL) {
+        pthread_rwlock_wrlock(&a->lock);
+        old = a->table;
+        a->table = t;
+        pthread_rwlock_unlock(&a->lock);
+    
+        // a rejected password may be the new one
+        pthread_mutex_lock(&a->cache_lock);
+        memset(a->rejected, 0, sizeof(a->rejected));
+        a->generation++;
+        pthread_mutex_unlock(&a->cache_lock);
+    
+        slogf(SLOG_INFO, "Loaded credentials from %s\n", a->path);
+    }
+    
+    pthread_mutex_unlock(&a->reload_lock);
+    
+    table_free(old);
+    
+    return t != NULL;
+}
+
+/**
+ * A check decided without the helper threads.
+ */
+static socksauth_check_t* check_decided(socksauth_user_t* user, void (*notify)(void* arg), void* notify_arg) {
+    socksauth_check_t* c = calloc(1, sizeof(socksauth_check_t));
+    
+    if (c == NULL) {
+        return NULL;
+    }
+    
+    c->user = user;
+    c->ok = user != NULL;
+    c->done = 1;
+    
+    if (notify != NULL) {
+        notify(notify_arg);
+    }
+    
+    return c;
+}
+
+socksauth_check_t* socksauth_verify_start(socksauth_t* a, const char* user, size_t user_len, const char* pass, size_t pass_len,
+        void (*notify)(void* arg), void* notify_arg) {
+    static const uint8_t no_digest[DIGEST_SIZE];
+    uint8_t name[DIGEST_SIZE];
+    uint8_t digest[DIGEST_SIZE];
+    auth_slot_t* slot = NULL;
+    socksauth_check_t* c = NULL;
+    
+    if (user_len > AUTH_NAME_MAX) {
+        user_len = AUTH_NAME_MAX; // still does the work, fails below
+    }
+    
+    keyed_digest(a, user, user_len, name);
+    
+    pthread_rwlock_rdlock(&a->lock);
+    
+    slot = table_find(a->table, name);
+    if (slot->user == NULL) {
+        slot = NULL;
+    }
+    
+    const char* setting = slot != NULL ? slot->crypted : a->table->dummy;
+    
+    if (setting == NULL) {
+        // unknown users are compared too, against a digest nothing hashes to
+        sha256(pass, pass_len, digest);
+    
+        int ok = digest_equal(digest, slot != NULL ? slot->digest : no_digest) && slot != NULL;
+    
+        pthread_rwlock_unlock(&a->lock);
+    
+        return check_decided(ok ? slot->user : NULL, notify, notify_arg);
+    }
+    
+    if (pass_len > AUTH_PASS_MAX || memchr(pass, 0, pass_len) != NULL) {
+        pthread_rwlock_unlock(&a->lock);
+    
+        return check_decided(NULL, notify, notify_arg);
+    }
+    
+    if ((c = calloc(1, sizeof(socksauth_check_t))) == NULL || (c->setting = strdup(setting)) == NULL) {
+        pthread_rwlock_unlock(&a->lock);
+        free(c);
+    
+        return NULL;
+    }
+    
+    memcpy(c->name, name, DIGEST_SIZE);
+    keyed_digest(a, pass, pass_len, c->keyed);
+    rejected_digest(a, name, pass, pass_len, c->rejected);
+    c->user = slot != NULL ? slot->user : NULL;
+    
+    // a user's accepted password and a pair that failed before are known
+    pthread_mutex_lock(&a->cache_lock);
+    int verified = slot != NULL && slot->has_verified && digest_equal(slot->verified, c->keyed);
+    int rejected = digest_equal(rejected_slot(a, c->rejected), c->rejected);
+    c->generation = a->generation;
+    pthread_mutex_unlock(&a->cache_lock);
+    
+    pthread_rwlock_unlock(&a->lock);
+    
+    if (verified || rejected) {
+        socksauth_user_t* found = verified ? c->user : NULL;
+    
+        check_free(c);
+    
+        return check_decided(found, notify, notify_arg);
+    }
+    
+    memcpy(c->plain, pass, pass_len);
+    c->plain[pass_len] = 0;
+    c->notify = notify;
+    c->notify_arg = notify_arg;
+    
+    pthread_mutex_lock(&a->work_lock);
+    
+    if (a->work_queued >= AUTH_QUEUE_MAX) {
+        pthread_mutex_unlock(&a->work_lock);
+        slogf_ratelimited(SLOG_WARN, "Credential checks backlogged, refusing logins\n");
+        check_free(c);
+    
+        return NULL;
+    }
+    
+    *a->work_tail = c;
+    a->work_tail = &c->next;
+    a->work_queued++;
+    pthread_cond_signal(&a->work_cond);
+    
+    pthread_mutex_unlock(&a->work_lock);
+    
+    return c;
+}
+
+int socksauth_check_done(socksauth_t* a, socksauth_check_t* c, socksauth_user_t** user) {
+    pthread_mutex_lock(&a->work_lock);
+    int done = c->done;
+    pthread_mutex_unlock(&a->work_lock);
+    
+    if (!done) {
+        return 0;
+    }
+    
+    *user = c->ok ? c->user : NULL;
+    check_free(c);
+    
+    return 1;
+}
+
+void socksauth_check_abandon(socksauth_t* a, socksauth_check_t* c) {
+    pthread_mutex_lock(&a->work_lock);
+    
+    c->abandoned = 1;
+    
+    if (c->done) {
+        check_free(c);
+    }
+    
+    pthread_mutex_unlock(&a->work_lock);
+}
+
+static int base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+socksauth_check_t* socksauth_verify_basic_start(socksauth_t* a, const char* token, size_t token_len,
+        void (*notify)(void* arg), void* notify_arg) {
+    char plain[AUTH_NAME_MAX + AUTH_PASS_MAX + 2];
+    size_t n = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+    
+    for (size_t i = 0; i < token_len && token[i] != '='; i++) {
+        int v = base64_value(token[i]);
+    
+        if (v < 0 || n >= sizeof(plain)) {
+            return check_decided(NULL, notify, notify_arg);
+        }
+    
+        acc = acc << 6 | v;
+        bits += 6;
+    
+        if (bits >= 8) {
+            bits -= 8;
+            plain[n++] = acc >> bits;
+        }
+    }
+    
+    char* sep = memchr(plain, ':', n);
+    socksauth_check_t* c;
+    
+    if (sep != NULL) {
+        c = socksauth_verify_start(a, plain, sep - plain, sep + 1, n - (sep + 1 - plain), notify, notify_arg);
+    } else {
+        c = check_decided(NULL, notify, notify_arg);
+    }
+    
+    memset(plain, 0, sizeof(plain));
+    
+    return c;
+}
+
+socksauth_user_t* socksauth_users(socksauth_t* a) {
+    return a->users;
+}
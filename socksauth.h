@@ -0,0 +1,97 @@
+/* 
+ * File:   socksauth.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Username / password store for RFC 1929 and HTTP Basic proxy
+ * authentication. The credential file has one "user:<crypt(3) hash>"
+ * entry per line, e.g. "user:$y$..." from mkpasswd -m yescrypt or
+ * "user:$6$..." (SHA-512). Unsalted "user:{SHA256}<hex digest>" and
+ * plaintext "user:password" entries are accepted for testing only. The
+ * slow hash is computed on the store's helper threads, for a user's first
+ * login with a password; later ones are checked against a cached keyed
+ * digest, and a password rejected before is refused at once. The store
+ * can be shared by all server threads and reloaded from any thread while
+ * they use it.
+ */
+
+#ifndef SOCKSAUTH_H
+#define	SOCKSAUTH_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct socksauth;
+typedef struct socksauth socksauth_t;
+
+struct socksauth_check;
+typedef struct socksauth_check socksauth_check_t;
+
+/**
+ * Authenticated identity. Identities live as long as the store, across
+ * reloads, so connections and per-user limits can keep the pointer.
+ */
+typedef struct socksauth_user {
+    const char* name;
+
+    /**
+     * totals over all threads, updated atomically
+     */
+    uint64_t connections;
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+
+    struct socksauth_user* next;
+} socksauth_user_t;
+
+socksauth_t* socksauth_open(const char* path);
+void socksauth_close(socksauth_t* a);
+
+/**
+ * Reads the credential file again and swaps the table in atomically.
+ * On error the current table stays in use.
+ */
+int socksauth_reload(socksauth_t* a);
+
+/**
+ * Starts checking a password. notify(notify_arg) is called once when the
+ * check is done, from a helper thread or before this returns, and also
+ * for an abandoned check. Returns NULL, without calling notify, when the
+ * check could not be started (out of memory, too many waiting). Checks
+ * take about the same time for unknown users and wrong passwords.
+ */
+socksauth_check_t* socksauth_verify_start(socksauth_t* a, const char* user, size_t user_len, const char* pass, size_t pass_len,
+        void (*notify)(void* arg), void* notify_arg);
+
+/**
+ * Same for the base64 "user:password" token of a Basic authorization.
+ */
+socksauth_check_t* socksauth_verify_basic_start(socksauth_t* a, const char* token, size_t token_len,
+        void (*notify)(void* arg), void* notify_arg);
+
+/**
+ * Returns 0 while the check runs. Once it is done, stores the identity
+ * when the password matched, NULL otherwise, frees the check and returns
+ * 1. Never blocks on crypt(3).
+ */
+int socksauth_check_done(socksauth_t* a, socksauth_check_t* c, socksauth_user_t** user);
+
+/**
+ * Gives up on a check, it is freed once the helper thread is done with it.
+ */
+void socksauth_check_abandon(socksauth_t* a, socksauth_check_t* c);
+
+/**
+ * All identities ever loaded, for stats.
+ */
+socksauth_user_t* socksauth_users(socksauth_t* a);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSAUTH_H */
+
@@ -0,0 +1,220 @@
+/* 
+ * File:   socksbench.c
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Latency benchmark: opens connections through a SOCKS5 proxy to a local
+ * echo server and reports tunnel setup time and request/response round
+ * trip percentiles.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+static int echo_listener = -1;
+
+static uint64_t monotonic_nsec(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void* echo_connection(void* arg) {
+    int s = (int)(intptr_t)arg;
+    char buf[4096];
+    ssize_t n;
+    
+    while ((n = recv(s, buf, sizeof(buf), 0)) > 0) {
+        if (send(s, buf, n, MSG_NOSIGNAL) != n) {
+            break;
+        }
+    }
+    
+    close(s);
+    
+    return NULL;
+}
+
+static void* echo_server(void* arg) {
+    for (;;) {
+        int s = accept(echo_listener, NULL, NULL);
+        pthread_t t;
+    
+        if (s == -1) {
+            break;
+        }
+        if (pthread_create(&t, NULL, echo_connection, (void*)(intptr_t)s) == 0) {
+            pthread_detach(t);
+        } else {
+            close(s);
+        }
+    }
+    
+    return NULL;
+}
+
+static int recv_all(int s, void* buf, size_t len) {
+    size_t got = 0;
+    
+    while (got < len) {
+        ssize_t n = recv(s, (char*)buf + got, len - got, 0);
+    
+        if (n <= 0) {
+            return 0;
+        }
+        got += n;
+    }
+    
+    return 1;
+}
+
+/**
+ * Connects through the proxy and completes the SOCKS5 CONNECT handshake.
+ */
+static int socks5_connect(struct sockaddr_in* proxy, struct sockaddr_in* target) {
+    uint8_t req[10] = { 5, 1, 0, 1 };
+    uint8_t rep[10];
+    int one = 1;
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    
+    if (s == -1) {
+        return -1;
+    }
+    
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    if (connect(s, (struct sockaddr*)proxy, sizeof(*proxy)) == -1
+            || send(s, "\x05\x01\x00", 3, MSG_NOSIGNAL) != 3
+            || !recv_all(s, rep, 2) || rep[1] != 0) {
+        goto fail;
+    }
+    
+    memcpy(req + 4, &target->sin_addr, 4);
+    memcpy(req + 8, &target->sin_port, 2);
+    
+    if (send(s, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) || !recv_all(s, rep, 10) || rep[1] != 0) {
+        goto fail;
+    }
+    
+    return s;
+    
+    fail:
+    
+    close(s);
+    
+    return -1;
+}
+
+static int u64_cmp(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* label, const char* what, uint64_t* samples, size_t n) {
+    if (n == 0) {
+        printf("%-12s %-8s no samples\n", label, what);
+        return;
+    }
+    
+    qsort(samples, n, sizeof(uint64_t), u64_cmp);
+    
+    printf("%-12s %-8s n=%-7zu p50=%8.1fus p90=%8.1fus p99=%8.1fus max=%8.1fus\n", label, what, n,
+            samples[n / 2] / 1e3, samples[n * 90 / 100] / 1e3, samples[n * 99 / 100] / 1e3, samples[n - 1] / 1e3);
+}
+
+int main(int argc, char** argv) {
+    int n_conns = 200;
+    int n_pings = 20;
+    int proxy_port = 1080;
+    const char* label = "simplesocks";
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "n:m:p:l:")) != -1) {
+        switch (opt) {
+            case 'n': n_conns = atoi(optarg); break;
+            case 'm': n_pings = atoi(optarg); break;
+            case 'p': proxy_port = atoi(optarg); break;
+            case 'l': label = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n connections] [-m pings] [-p proxy_port] [-l label]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    
+    struct sockaddr_in proxy, target;
+    socklen_t target_len = sizeof(target);
+    pthread_t echo_thread;
+    
+    memset(&proxy, 0, sizeof(proxy));
+    proxy.sin_family = AF_INET;
+    proxy.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    proxy.sin_port = htons(proxy_port);
+    
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if ((echo_listener = socket(AF_INET, SOCK_STREAM, 0)) == -1
+            || bind(echo_listener, (struct sockaddr*)&target, sizeof(target)) == -1
+            || listen(echo_listener, 128) == -1
+            || getsockname(echo_listener, (struct sockaddr*)&target, &target_len) == -1) {
+        perror("echo server");
+        return EXIT_FAILURE;
+    }
+    
+    pthread_create(&echo_thread, NULL, echo_server, NULL);
+    
+    uint64_t* setup = calloc(n_conns, sizeof(uint64_t));
+    uint64_t* rtt = calloc((size_t)n_conns * n_pings, sizeof(uint64_t));
+    size_t n_setup = 0, n_rtt = 0;
+    int failures = 0;
+    
+    for (int i = 0; i < n_conns; i++) {
+        uint64_t t0 = monotonic_nsec();
+        int s = socks5_connect(&proxy, &target);
+    
+        if (s == -1) {
+            failures++;
+            continue;
+        }
+    
+        setup[n_setup++] = monotonic_nsec() - t0;
+    
+        for (int j = 0; j < n_pings; j++) {
+            char c = 'x';
+    
+            t0 = monotonic_nsec();
+            if (send(s, &c, 1, MSG_NOSIGNAL) != 1 || !recv_all(s, &c, 1)) {
+                failures++;
+                break;
+            }
+            rtt[n_rtt++] = monotonic_nsec() - t0;
+        }
+    
+        close(s);
+    }
+    
+    report(label, "setup", setup, n_setup);
+    report(label, "rtt", rtt, n_rtt);
+    if (failures > 0) {
+        printf("%-12s %d failures\n", label, failures);
+    }
+    
+    free(setup);
+    free(rtt);
+    
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,314 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/tcp.h>
+
+#include "socksbpf.h"
+#include "sockslog.h"
+
+struct socksbpf {
+    int map_fd;
+    int prog_fd;
+    int attach_type;
+};
+
+/**
+ * Sockhash key, filled from the skb by the verdict program and from
+ * getpeername() / getsockname() by socksbpf_link(). IPv4 addresses use
+ * the first word only.
+ */
+typedef struct {
+    uint32_t remote[4];
+    uint32_t local[4];
+    uint32_t remote_port; // __sk_buff layout: network order in the upper 16 bits on little endian
+    uint32_t local_port; // host order
+} socksbpf_key_t;
+
+#define KEY_OFF(f) (-(int)sizeof(socksbpf_key_t) + (int)offsetof(socksbpf_key_t, f))
+#define SKB_OFF(f) ((int)offsetof(struct __sk_buff, f))
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s) INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i) INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i) INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define LDX_W(d, s, o) INSN(BPF_LDX | BPF_MEM | BPF_W, d, s, o, 0)
+#define STX_W(d, s, o) INSN(BPF_STX | BPF_MEM | BPF_W, d, s, o, 0)
+#define ST_DW(d, o, i) INSN(BPF_ST | BPF_MEM | BPF_DW, d, 0, o, i)
+#define JNE_IMM(d, i, o) INSN(BPF_JMP | BPF_JNE | BPF_K, d, 0, o, i)
+#define JA(o) INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define LD_MAP_FD(d, fd) INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define CALL(f) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static long sys_bpf(int cmd, union bpf_attr* attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int load_verdict_prog(int map_fd) {
+    struct bpf_insn prog[] = {
+        MOV64_REG(BPF_REG_6, BPF_REG_1),
+        ST_DW(BPF_REG_10, KEY_OFF(remote), 0),
+        ST_DW(BPF_REG_10, KEY_OFF(remote) + 8, 0),
+        ST_DW(BPF_REG_10, KEY_OFF(local), 0),
+        ST_DW(BPF_REG_10, KEY_OFF(local) + 8, 0),
+        LDX_W(BPF_REG_2, BPF_REG_6, SKB_OFF(family)),
+        JNE_IMM(BPF_REG_2, AF_INET, 5),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip4)),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(remote)),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(local_ip4)),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(local)),
+        JA(16),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip6[0])),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(remote[0])),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip6[1])),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(remote[1])),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip6[2])),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(remote[2])),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(remote_ip6[3])),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(remote[3])),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(local_ip6[0])),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(local[0])),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(local_ip6[1])),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(local[1])),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(local_ip6[2])),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(local[2])),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(local_ip6[3])),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(local[3])),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(remote_port)),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(remote_port)),
+        LDX_W(BPF_REG_3, BPF_REG_6, SKB_OFF(local_port)),
+        STX_W(BPF_REG_10, BPF_REG_3, KEY_OFF(local_port)),
+        // return bpf_sk_redirect_hash(skb, map, &key, 0): egress on the peer socket
+        MOV64_REG(BPF_REG_1, BPF_REG_6),
+        LD_MAP_FD(BPF_REG_2, map_fd),
+        MOV64_REG(BPF_REG_3, BPF_REG_10),
+        ADD64_IMM(BPF_REG_3, -(int)sizeof(socksbpf_key_t)),
+        MOV64_IMM(BPF_REG_4, 0),
+        CALL(BPF_FUNC_sk_redirect_hash),
+        EXIT(),
+    };
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/**
+ * The stream parser is only needed by kernels without BPF_SK_SKB_VERDICT
+ * (before 5.13): each skb is one message.
+ */
+static int load_parser_prog(void) {
+    struct bpf_insn prog[] = {
+        LDX_W(BPF_REG_0, BPF_REG_1, SKB_OFF(len)),
+        EXIT(),
+    };
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int prog_attach(int map_fd, int prog_fd, int type) {
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd = map_fd;
+    attr.attach_bpf_fd = prog_fd;
+    attr.attach_type = type;
+    
+    return sys_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+socksbpf_t* socksbpf_open(int max_sockets) {
+    socksbpf_t* b = calloc(1, sizeof(socksbpf_t));
+    union bpf_attr attr;
+    int parser_fd = -1;
+    
+    if (b == NULL) {
+        return NULL;
+    }
+    
+    b->prog_fd = -1;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+    attr.key_size = sizeof(socksbpf_key_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = max_sockets;
+    
+    if ((b->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1) {
+        slogf(SLOG_INFO, "sockmap: map create: %s\n", strerror(errno));
+        goto fail;
+    }
+    
+    if ((b->prog_fd = load_verdict_prog(b->map_fd)) == -1) {
+        slogf(SLOG_INFO, "sockmap: program load: %s\n", strerror(errno));
+        goto fail;
+    }
+    
+    b->attach_type = BPF_SK_SKB_VERDICT;
+    
+    if (prog_attach(b->map_fd, b->prog_fd, b->attach_type) == -1) {
+        b->attach_type = BPF_SK_SKB_STREAM_VERDICT;
+        
+        if ((parser_fd = load_parser_prog()) == -1
+                || prog_attach(b->map_fd, parser_fd, BPF_SK_SKB_STREAM_PARSER) == -1
+                || prog_attach(b->map_fd, b->prog_fd, b->attach_type) == -1) {
+            slogf(SLOG_INFO, "sockmap: program attach: %s\n", strerror(errno));
+            goto fail;
+        }
+        
+        close(parser_fd); // the map holds a reference
+    }
+    
+    return b;
+    
+    fail:
+    
+    if (parser_fd != -1) {
+        close(parser_fd);
+    }
+    socksbpf_close(b);
+    
+    return NULL;
+}
+
+void socksbpf_close(socksbpf_t* b) {
+    if (b == NULL) {
+        return;
+    }
+    
+    if (b->prog_fd != -1) {
+        close(b->prog_fd);
+    }
+    if (b->map_fd != -1) {
+        close(b->map_fd);
+    }
+    
+    free(b);
+}
+
+static int sock_key(int fd, socksbpf_key_t* key) {
+    struct sockaddr_storage peer, local;
+    socklen_t peer_len = sizeof(peer), local_len = sizeof(local);
+    
+    if (getpeername(fd, (struct sockaddr*)&peer, &peer_len) == -1
+            || getsockname(fd, (struct sockaddr*)&local, &local_len) == -1) {
+        return 0;
+    }
+    
+    memset(key, 0, sizeof(socksbpf_key_t));
+    
+    uint16_t remote_port, local_port;
+    
+    if (peer.ss_family == AF_INET) {
+        struct sockaddr_in* p4 = (struct sockaddr_in*)&peer;
+        struct sockaddr_in* l4 = (struct sockaddr_in*)&local;
+        
+        key->remote[0] = p4->sin_addr.s_addr;
+        key->local[0] = l4->sin_addr.s_addr;
+        remote_port = p4->sin_port;
+        local_port = l4->sin_port;
+    } else if (peer.ss_family == AF_INET6) {
+        struct sockaddr_in6* p6 = (struct sockaddr_in6*)&peer;
+        struct sockaddr_in6* l6 = (struct sockaddr_in6*)&local;
+        
+        memcpy(key->remote, &p6->sin6_addr, 16);
+        memcpy(key->local, &l6->sin6_addr, 16);
+        remote_port = p6->sin6_port;
+        local_port = l6->sin6_port;
+    } else {
+        return 0;
+    }
+    
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    key->remote_port = (uint32_t)remote_port << 16;
+#else
+    key->remote_port = remote_port;
+#endif
+    key->local_port = ntohs(local_port);
+    
+    return 1;
+}
+
+static int map_update(socksbpf_t* b, socksbpf_key_t* key, int fd) {
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = b->map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)&fd;
+    attr.flags = BPF_ANY;
+    
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void map_delete(socksbpf_t* b, socksbpf_key_t* key) {
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = b->map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    
+    sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+int socksbpf_link(socksbpf_t* b, int fd_a, int fd_b) {
+    socksbpf_key_t key_a, key_b;
+    
+    if (!sock_key(fd_a, &key_a) || !sock_key(fd_b, &key_b)) {
+        return 0;
+    }
+    
+    // skbs arriving on a are looked up with a's key and sent out on b
+    if (map_update(b, &key_a, fd_b) == -1) {
+        slogf_ratelimited(SLOG_INFO, "sockmap: update: %s\n", strerror(errno));
+        return 0;
+    }
+    
+    if (map_update(b, &key_b, fd_a) == -1) {
+        slogf_ratelimited(SLOG_INFO, "sockmap: update: %s\n", strerror(errno));
+        map_delete(b, &key_a);
+        return 0;
+    }
+    
+    return 1;
+}
+
+int socksbpf_bytes_read(int fd, uint64_t* bytes) {
+    struct tcp_info ti;
+    socklen_t ti_len = sizeof(ti);
+    int unread;
+    
+    // glibc's struct tcp_info stops short of the RFC 4898 counters
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &ti_len) == -1
+            || ti_len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(ti.tcpi_bytes_received)
+            || ioctl(fd, FIONREAD, &unread) == -1) {
+        return 0;
+    }
+    
+    *bytes = ti.tcpi_bytes_received - unread;
+    
+    return 1;
+}
@@ -0,0 +1,48 @@
+/* 
+ * File:   socksbpf.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * In-kernel relaying of established tunnels. Both sockets of a tunnel are
+ * put into a BPF sockhash whose sk_skb verdict program redirects every
+ * received skb to the other socket, so tunnel data no longer passes
+ * through user space. Uses the raw bpf() syscall, no libbpf needed.
+ */
+
+#ifndef SOCKSBPF_H
+#define	SOCKSBPF_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct socksbpf;
+typedef struct socksbpf socksbpf_t;
+
+/**
+ * Creates the sockhash and loads / attaches the verdict program. Returns
+ * NULL when the kernel or the process privileges do not allow it.
+ */
+socksbpf_t* socksbpf_open(int max_sockets);
+void socksbpf_close(socksbpf_t* b);
+
+/**
+ * Redirects traffic between two established TCP sockets in both
+ * directions. Entries are removed by the kernel when a socket is closed.
+ */
+int socksbpf_link(socksbpf_t* b, int fd_a, int fd_b);
+
+/**
+ * Payload bytes taken off a TCP socket so far, by reads or by the verdict
+ * program, from the kernel's counters. Returns 0 when the kernel does not
+ * report them.
+ */
+int socksbpf_bytes_read(int fd, uint64_t* bytes);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSBPF_H */
+
@@ -0,0 +1,270 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "socksbreaker.h"
+#include "sockslog.h"
+#include "socksclock.h"
+
+/**
+ * 4-way set associative table, a new destination replaces the least
+ * recently used closed circuit of its set (an open one if all are).
+ */
+#define BREAKER_SETS 128
+#define BREAKER_WAYS 4
+
+/**
+ * 'h' or 'a' (host or address namespace) followed by "name:port"
+ */
+#define BREAKER_KEY_MAX 272
+
+typedef struct {
+    char key[BREAKER_KEY_MAX];
+    uint32_t hash;
+    
+    int failures; // consecutive
+    uint32_t latency_usec; // moving average of successful connects
+    
+    uint64_t open_until; // 0 while closed
+    uint64_t probe_until; // a probe is out until then
+    uint32_t backoff_ms;
+    
+    uint64_t last_used;
+} breaker_entry_t;
+
+struct socksbreaker {
+    socksbreaker_config_t config;
+    
+    breaker_entry_t entries[BREAKER_SETS][BREAKER_WAYS];
+    
+    socksbreaker_stats_t stats;
+};
+
+socksbreaker_t* socksbreaker_new(const socksbreaker_config_t* config) {
+    socksbreaker_t* b = calloc(1, sizeof(socksbreaker_t));
+    
+    if (b == NULL) {
+        return NULL;
+    }
+    
+    b->config = *config;
+    if (b->config.failures < 1) {
+        b->config.failures = 1;
+    }
+    if (b->config.max_open_ms < b->config.open_ms) {
+        b->config.max_open_ms = b->config.open_ms;
+    }
+    
+    return b;
+}
+
+void socksbreaker_free(socksbreaker_t* b) {
+    free(b);
+}
+
+static int host_key(char* key, const char* host, uint16_t port) {
+    int n = snprintf(key, BREAKER_KEY_MAX, "h%s:%u", host, port);
+    
+    return n > 0 && n < BREAKER_KEY_MAX;
+}
+
+static int addr_key(char* key, const struct sockaddr* addr) {
+    char ip[INET6_ADDRSTRLEN];
+    
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in* a4 = (const struct sockaddr_in*)addr;
+    
+        inet_ntop(AF_INET, &a4->sin_addr, ip, sizeof(ip));
+        snprintf(key, BREAKER_KEY_MAX, "a%s:%u", ip, ntohs(a4->sin_port));
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6* a6 = (const struct sockaddr_in6*)addr;
+    
+        inet_ntop(AF_INET6, &a6->sin6_addr, ip, sizeof(ip));
+        snprintf(key, BREAKER_KEY_MAX, "a[%s]:%u", ip, ntohs(a6->sin6_port));
+    } else {
+        return 0;
+    }
+    
+    return 1;
+}
+
+static uint32_t key_hash(const char* key) {
+    uint32_t h = 2166136261u;
+    
+    for (; *key != 0; key++) {
+        h = (h ^ (uint8_t)*key) * 16777619u;
+    }
+    
+    return h;
+}
+
+/**
+ * Replacement order: free slots, then closed circuits, least recently
+ * used first.
+ */
+static uint64_t entry_rank(const breaker_entry_t* e) {
+    if (e->key[0] == 0) {
+        return 0;
+    }
+    
+    return e->open_until == 0 ? e->last_used : UINT64_MAX / 2 + e->last_used / 2;
+}
+
+/**
+ * Entry of key, a fresh one when create is set, NULL otherwise.
+ */
+static breaker_entry_t* entry_find(socksbreaker_t* b, const char* key, int create, uint64_t now) {
+    uint32_t hash = key_hash(key);
+    breaker_entry_t* set = b->entries[hash % BREAKER_SETS];
+    breaker_entry_t* victim = NULL;
+    
+    for (int i = 0; i < BREAKER_WAYS; i++) {
+        breaker_entry_t* e = &set[i];
+    
+        if (e->key[0] != 0 && e->hash == hash && strcmp(e->key, key) == 0) {
+            e->last_used = now;
+            return e;
+        }
+    
+        if (victim == NULL || entry_rank(e) < entry_rank(victim)) {
+            victim = e;
+        }
+    }
+    
+    if (!create) {
+        return NULL;
+    }
+    
+    if (victim->key[0] != 0 && victim->open_until != 0) {
+        b->stats.open--;
+    }
+    
+    memset(victim, 0, sizeof(*victim));
+    strcpy(victim->key, key);
+    victim->hash = hash;
+    victim->last_used = now;
+    
+    return victim;
+}
+
+static int entry_refuses(const breaker_entry_t* e, uint64_t now) {
+    return e != NULL && e->open_until != 0 && (now < e->open_until || now < e->probe_until);
+}
+
+/**
+ * Half-open: the allowed request probes, the others wait for its outcome
+ * or until the probe is overdue.
+ */
+static void entry_probe(breaker_entry_t* e, uint64_t now) {
+    if (e == NULL || e->open_until == 0) {
+        return;
+    }
+    
+    e->probe_until = now + (uint64_t)e->backoff_ms * 1000;
+    
+    slogf(SLOG_DEBUG, "Probing %s\n", e->key + 1);
+}
+
+int socksbreaker_allow(socksbreaker_t* b, const char* host, uint16_t port, const struct sockaddr* addr) {
+    char key[BREAKER_KEY_MAX];
+    uint64_t now = monotonic_usec();
+    breaker_entry_t* eh = NULL;
+    breaker_entry_t* ea = NULL;
+    
+    if (host != NULL && host_key(key, host, port)) {
+        eh = entry_find(b, key, 0, now);
+    }
+    if (addr != NULL && addr_key(key, addr)) {
+        ea = entry_find(b, key, 0, now);
+    }
+    
+    // no probe is granted for one key when the other one refuses
+    if (entry_refuses(eh, now) || entry_refuses(ea, now)) {
+        b->stats.rejected++;
+        return 0;
+    }
+    
+    entry_probe(eh, now);
+    entry_probe(ea, now);
+    
+    return 1;
+}
+
+static void entry_report(socksbreaker_t* b, const char* key, int outcome, uint64_t elapsed_usec, uint64_t now) {
+    breaker_entry_t* e = entry_find(b, key, outcome != SOCKSBREAKER_ABANDONED, now);
+    
+    if (e == NULL) {
+        return;
+    }
+    
+    if (outcome == SOCKSBREAKER_ABANDONED) {
+        uint64_t slow = (uint64_t)b->config.slow_ms * 1000;
+    
+        if (slow < (uint64_t)e->latency_usec * 4) {
+            slow = (uint64_t)e->latency_usec * 4;
+        }
+    
+        if (elapsed_usec < slow) {
+            e->probe_until = 0; // inconclusive, let the next request probe
+            return;
+        }
+    
+        outcome = SOCKSBREAKER_FAILED;
+    }
+    
+    if (outcome == SOCKSBREAKER_OK) {
+        e->latency_usec = e->latency_usec == 0 ? elapsed_usec : e->latency_usec - e->latency_usec / 8 + elapsed_usec / 8;
+        e->failures = 0;
+    
+        if (e->open_until != 0) {
+            slogf(SLOG_INFO, "%s reachable again\n", e->key + 1);
+            e->open_until = 0;
+            e->probe_until = 0;
+            b->stats.closed++;
+            b->stats.open--;
+        }
+    
+        return;
+    }
+    
+    e->failures++;
+    
+    if (e->open_until != 0) {
+        if (e->probe_until != 0) { // the probe failed
+            e->probe_until = 0;
+            e->backoff_ms = e->backoff_ms * 2 < (uint32_t)b->config.max_open_ms ? e->backoff_ms * 2 : b->config.max_open_ms;
+        }
+        e->open_until = now + (uint64_t)e->backoff_ms * 1000;
+        return;
+    }
+    
+    if (e->failures >= b->config.failures) {
+        e->backoff_ms = b->config.open_ms;
+        e->open_until = now + (uint64_t)e->backoff_ms * 1000;
+        b->stats.opened++;
+        b->stats.open++;
+    
+        slogf(SLOG_INFO, "%s failed %d times, refusing it for %u ms\n", e->key + 1, e->failures, e->backoff_ms);
+    }
+}
+
+void socksbreaker_report(socksbreaker_t* b, const char* host, uint16_t port, const struct sockaddr* addr, int outcome, uint64_t elapsed_usec) {
+    char key[BREAKER_KEY_MAX];
+    uint64_t now = monotonic_usec();
+    
+    if (host != NULL && host_key(key, host, port)) {
+        entry_report(b, key, outcome, elapsed_usec, now);
+    }
+    if (addr != NULL && addr_key(key, addr)) {
+        entry_report(b, key, outcome, elapsed_usec, now);
+    }
+}
+
+void socksbreaker_stats(socksbreaker_t* b, socksbreaker_stats_t* stats) {
+    *stats = b->stats;
+}
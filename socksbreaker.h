@@ -0,0 +1,90 @@
+/* 
+ * File:   socksbreaker.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Destination circuit breaker. Remembers recent connect outcomes and
+ * times per requested host:port and per resolved address:port; after
+ * repeated failures the destination's circuit opens and requests for it
+ * are refused without resolving or dialing until a backoff expires. Then
+ * a single probe request is let through, it closes the circuit when it
+ * connects and doubles the backoff when it fails. Not thread safe: a
+ * breaker belongs to one server loop thread.
+ */
+
+#ifndef SOCKSBREAKER_H
+#define	SOCKSBREAKER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct socksbreaker;
+typedef struct socksbreaker socksbreaker_t;
+
+typedef struct socksbreaker_config {
+    /**
+     * consecutive failures opening the circuit
+     */
+    int failures;
+
+    /**
+     * first backoff, doubled by every failed probe up to max_open_ms
+     */
+    int open_ms;
+    int max_open_ms;
+
+    /**
+     * an attempt given up (client gone, timeout) counts as a failure
+     * after this long, or after 4 times the usual connect time if longer
+     */
+    int slow_ms;
+} socksbreaker_config_t;
+
+typedef struct {
+    /**
+     * requests refused, circuits opened and closed again by a probe
+     */
+    uint64_t rejected;
+    uint64_t opened;
+    uint64_t closed;
+
+    /**
+     * circuits open now
+     */
+    int open;
+} socksbreaker_stats_t;
+
+/**
+ * socksbreaker_report() outcomes
+ */
+#define SOCKSBREAKER_OK 0
+#define SOCKSBREAKER_FAILED 1
+#define SOCKSBREAKER_ABANDONED 2
+
+socksbreaker_t* socksbreaker_new(const socksbreaker_config_t* config);
+void socksbreaker_free(socksbreaker_t* b);
+
+/**
+ * Returns 0 when the circuit of the host (may be NULL) or of the address
+ * (may be NULL) is open. A returned 1 may be the probe of a half-open
+ * circuit, every allowed attempt has to be reported.
+ */
+int socksbreaker_allow(socksbreaker_t* b, const char* host, uint16_t port, const struct sockaddr* addr);
+
+/**
+ * Outcome of an attempt, elapsed_usec since it was allowed. Pass the
+ * host and the address that were checked, NULL for those that were not.
+ */
+void socksbreaker_report(socksbreaker_t* b, const char* host, uint16_t port, const struct sockaddr* addr, int outcome, uint64_t elapsed_usec);
+
+void socksbreaker_stats(socksbreaker_t* b, socksbreaker_stats_t* stats);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSBREAKER_H */
+
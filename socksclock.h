@@ -0,0 +1,31 @@
+/* 
+ * File:   socksclock.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Monotonic time for deadlines and intervals, shared by the modules.
+ */
+
+#ifndef SOCKSCLOCK_H
+#define	SOCKSCLOCK_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t monotonic_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSCLOCK_H */
+
@@ -0,0 +1,242 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "sockslog.h"
+
+#define LOG_QUEUE_SLOTS 4096 /* power of two */
+#define LOG_MSG_MAX 240
+#define LOG_FLUSH_INTERVAL_NS 10000000
+#define LOG_BATCH_SIZE 65536
+
+typedef struct {
+    uint64_t seq;
+    struct timespec ts;
+    int level;
+    char text[LOG_MSG_MAX];
+} log_slot_t;
+
+int socks_log_level = SLOG_INFO;
+
+static FILE* log_stream = NULL;
+static int log_async = 0;
+static volatile int log_stopping = 0;
+static pthread_t log_thread;
+
+static log_slot_t log_slots[LOG_QUEUE_SLOTS];
+static uint64_t log_head = 0;
+static uint64_t log_tail = 0;
+static uint64_t log_dropped = 0;
+
+static const char level_chars[] = "EWID";
+
+static int format_line(char* out, size_t size, const struct timespec* ts, int level, const char* text) {
+    struct tm tm;
+    
+    localtime_r(&ts->tv_sec, &tm);
+    
+    return snprintf(out, size, "%02d:%02d:%02d.%03ld %c %s", tm.tm_hour, tm.tm_min, tm.tm_sec,
+            ts->tv_nsec / 1000000, level_chars[level & 3], text);
+}
+
+/**
+ * Multi-producer enqueue, each slot carries a sequence number telling
+ * whether it is free for position pos (seq == pos) or holds a message
+ * (seq == pos + 1).
+ */
+static log_slot_t* queue_claim(void) {
+    uint64_t pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    
+    for (;;) {
+        log_slot_t* slot = &log_slots[pos & (LOG_QUEUE_SLOTS - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return slot;
+            }
+        } else if (diff < 0) {
+            return NULL; // full
+        } else {
+            pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void queue_publish(log_slot_t* slot) {
+    __atomic_store_n(&slot->seq, __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+void socks_log_write(int level, const char* fmt, ...) {
+    va_list ap;
+    
+    if (!log_async) {
+        char text[LOG_MSG_MAX];
+        char line[LOG_MSG_MAX + 32];
+        struct timespec ts;
+        
+        clock_gettime(CLOCK_REALTIME, &ts);
+        
+        va_start(ap, fmt);
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        
+        format_line(line, sizeof(line), &ts, level, text);
+        fputs(line, log_stream != NULL ? log_stream : stderr);
+        return;
+    }
+    
+    log_slot_t* slot = queue_claim();
+    
+    if (slot == NULL) {
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &slot->ts);
+    slot->level = level;
+    
+    va_start(ap, fmt);
+    vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+    
+    queue_publish(slot);
+}
+
+int socks_log_ratelimit(int level, socks_log_ratelimit_t* rl) {
+    // call sites are shared by all loop threads, the thread that moves the
+    // window on resets it and reports what the last one suppressed
+    time_t now = time(NULL);
+    time_t window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+    
+    if (now != window && __atomic_compare_exchange_n(&rl->window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        uint32_t suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+        
+        __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+        
+        if (suppressed > 0) {
+            socks_log_write(level, "(%u similar messages suppressed)\n", suppressed);
+        }
+    }
+    
+    if (__atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) >= SLOG_RATELIMIT_BURST) {
+        __atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    
+    return 1;
+}
+
+/**
+ * Drains the queue into one buffer and writes it out, returns the number
+ * of messages written.
+ */
+static int flush_queue(void) {
+    static char batch[LOG_BATCH_SIZE];
+    size_t batch_len = 0;
+    int n = 0;
+    
+    for (;;) {
+        log_slot_t* slot = &log_slots[log_tail & (LOG_QUEUE_SLOTS - 1)];
+        
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail + 1) {
+            break;
+        }
+        
+        if (batch_len + LOG_MSG_MAX + 32 > sizeof(batch)) {
+            fwrite(batch, 1, batch_len, log_stream);
+            batch_len = 0;
+        }
+        
+        int len = format_line(batch + batch_len, sizeof(batch) - batch_len, &slot->ts, slot->level, slot->text);
+        batch_len += len < sizeof(batch) - batch_len ? len : sizeof(batch) - batch_len - 1;
+        
+        __atomic_store_n(&slot->seq, log_tail + LOG_QUEUE_SLOTS, __ATOMIC_RELEASE);
+        log_tail++;
+        n++;
+    }
+    
+    if (batch_len > 0) {
+        fwrite(batch, 1, batch_len, log_stream);
+    }
+    
+    return n;
+}
+
+static void* log_thread_main(void* arg) {
+    uint64_t reported_dropped = 0;
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL_NS };
+    
+    while (!log_stopping) {
+        int n = flush_queue();
+        uint64_t dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        
+        if (dropped != reported_dropped) {
+            fprintf(log_stream, "%llu log messages dropped\n", (unsigned long long)(dropped - reported_dropped));
+            reported_dropped = dropped;
+            n++;
+        }
+        
+        if (n > 0) {
+            fflush(log_stream);
+        } else {
+            nanosleep(&interval, NULL);
+        }
+    }
+    
+    flush_queue();
+    fflush(log_stream);
+    
+    return NULL;
+}
+
+int socks_log_start(FILE* stream) {
+    sigset_t all, old;
+    
+    if (log_async) {
+        return 1;
+    }
+    
+    log_stream = stream;
+    log_stopping = 0;
+    
+    for (uint64_t i = 0; i < LOG_QUEUE_SLOTS; i++) {
+        log_slots[i].seq = log_head + i;
+    }
+    log_tail = log_head;
+    
+    // signals are for the event loop threads
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int r = pthread_create(&log_thread, NULL, log_thread_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (r != 0) {
+        return 0;
+    }
+    
+    log_async = 1;
+    
+    return 1;
+}
+
+void socks_log_stop(void) {
+    if (!log_async) {
+        return;
+    }
+    
+    log_stopping = 1;
+    pthread_join(log_thread, NULL);
+    log_async = 0;
+}
+
+uint64_t socks_log_dropped(void) {
+    return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
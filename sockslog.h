@@ -0,0 +1,76 @@
+/* 
+ * File:   sockslog.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Level-gated logging for the event loop. A disabled call costs one
+ * branch; enabled messages are formatted into a lock-free queue that a
+ * background thread writes out in batches. When the queue is full the
+ * message is dropped and counted instead of blocking the caller.
+ */
+
+#ifndef SOCKSLOG_H
+#define	SOCKSLOG_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SLOG_ERROR 0
+#define SLOG_WARN 1
+#define SLOG_INFO 2
+#define SLOG_DEBUG 3
+
+/**
+ * Calls above this level are compiled out.
+ */
+#ifndef SOCKS_LOG_MAX_LEVEL
+#define SOCKS_LOG_MAX_LEVEL SLOG_DEBUG
+#endif
+
+#define SLOG_RATELIMIT_BURST 5
+
+typedef struct {
+    time_t window;
+    uint32_t count;
+    uint32_t suppressed;
+} socks_log_ratelimit_t;
+
+/**
+ * Runtime level, SLOG_INFO by default.
+ */
+extern int socks_log_level;
+
+/**
+ * Starts the flusher thread writing to stream. Without it messages are
+ * written synchronously.
+ */
+int socks_log_start(FILE* stream);
+void socks_log_stop(void);
+uint64_t socks_log_dropped(void);
+
+void socks_log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+int socks_log_ratelimit(int level, socks_log_ratelimit_t* rl);
+
+#define slog_enabled(level) ((level) <= SOCKS_LOG_MAX_LEVEL && (level) <= socks_log_level)
+
+#define slogf(level, ...) do { if (slog_enabled(level)) { socks_log_write((level), __VA_ARGS__); } } while (0)
+
+/**
+ * Like slogf, but lets through at most SLOG_RATELIMIT_BURST messages per
+ * second from the call site, reporting how many were suppressed.
+ */
+#define slogf_ratelimited(level, ...) do { \
+    static socks_log_ratelimit_t slog_rl_; \
+    if (slog_enabled(level) && socks_log_ratelimit((level), &slog_rl_)) { socks_log_write((level), __VA_ARGS__); } \
+} while (0)
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSLOG_H */
+
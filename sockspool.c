@@ -0,0 +1,366 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+#include <errorfc.h>
+
+#include "sockspool.h"
+#include "sockslog.h"
+#include "socksclock.h"
+
+/**
+ * Destinations tracked, the least requested one without pooled sockets
+ * is replaced when the table is full.
+ */
+#define POOL_MAX_DESTS 128
+
+/**
+ * Connect rates are a moving average over 1 s windows, destinations below
+ * POOL_MIN_RATE connects/s get no pooled sockets and the others get
+ * enough for about a second of requests.
+ */
+#define POOL_RATE_WINDOW_USEC 1000000
+#define POOL_MIN_RATE 0.2f
+
+/**
+ * Health check / refill interval while the pool is in use.
+ */
+#define POOL_TICK_USEC 100000
+
+/**
+ * A destination whose pooled socket failed is not pre-connected again
+ * for this long, a target that went away should not be hammered.
+ */
+#define POOL_FAIL_BACKOFF_USEC 5000000
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    
+    uint32_t count; // connects in the current window
+    float rate;
+    uint64_t backoff_until;
+    
+    int n_pooled;
+    int fds[SOCKSPOOL_MAX_PER_DEST]; // oldest first
+    uint64_t born[SOCKSPOOL_MAX_PER_DEST];
+} pool_dest_t;
+
+struct sockspool {
+    sockspool_config_t config;
+    
+    pool_dest_t dests[POOL_MAX_DESTS];
+    int n_dests;
+    
+    int n_pooled;
+    uint64_t window_end;
+    uint64_t next_due;
+    
+    sockspool_stats_t stats;
+};
+
+sockspool_t* sockspool_new(const sockspool_config_t* config) {
+    sockspool_t* p = calloc(1, sizeof(sockspool_t));
+    
+    if (p == NULL) {
+        return NULL;
+    }
+    
+    p->config = *config;
+    if (p->config.max_per_dest > SOCKSPOOL_MAX_PER_DEST) {
+        p->config.max_per_dest = SOCKSPOOL_MAX_PER_DEST;
+    }
+    
+    p->window_end = monotonic_usec() + POOL_RATE_WINDOW_USEC;
+    p->next_due = UINT64_MAX;
+    
+    return p;
+}
+
+static void dest_drop(sockspool_t* p, pool_dest_t* d, int i) {
+    WARN_IFM1(close(d->fds[i]));
+    
+    memmove(&d->fds[i], &d->fds[i + 1], (d->n_pooled - i - 1) * sizeof(d->fds[0]));
+    memmove(&d->born[i], &d->born[i + 1], (d->n_pooled - i - 1) * sizeof(d->born[0]));
+    
+    d->n_pooled--;
+    p->n_pooled--;
+}
+
+static void dest_failed(sockspool_t* p, pool_dest_t* d, uint64_t now) {
+    p->stats.failed++;
+    d->backoff_until = now + POOL_FAIL_BACKOFF_USEC;
+}
+
+void sockspool_free(sockspool_t* p) {
+    if (p == NULL) {
+        return;
+    }
+    
+    for (int i = 0; i < p->n_dests; i++) {
+        while (p->dests[i].n_pooled > 0) {
+            dest_drop(p, &p->dests[i], 0);
+        }
+    }
+    
+    free(p);
+}
+
+static int addr_equal(const struct sockaddr* a, const struct sockaddr* b) {
+    if (a->sa_family != b->sa_family) {
+        return 0;
+    }
+    
+    if (a->sa_family == AF_INET) {
+        const struct sockaddr_in* a4 = (const struct sockaddr_in*)a;
+        const struct sockaddr_in* b4 = (const struct sockaddr_in*)b;
+    
+        return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+    
+    if (a->sa_family == AF_INET6) {
+        const struct sockaddr_in6* a6 = (const struct sockaddr_in6*)a;
+        const struct sockaddr_in6* b6 = (const struct sockaddr_in6*)b;
+    
+        return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+    }
+    
+    return 0;
+}
+
+static pool_dest_t* dest_find(sockspool_t* p, const struct sockaddr* addr, socklen_t addr_len) {
+    pool_dest_t* victim = NULL;
+    
+    for (int i = 0; i < p->n_dests; i++) {
+        if (addr_equal((struct sockaddr*)&p->dests[i].addr, addr)) {
+            return &p->dests[i];
+        }
+    }
+    
+    if (addr_len > sizeof(struct sockaddr_storage)) {
+        return NULL;
+    }
+    
+    if (p->n_dests < POOL_MAX_DESTS) {
+        victim = &p->dests[p->n_dests++];
+    } else {
+        for (int i = 0; i < p->n_dests; i++) {
+            pool_dest_t* d = &p->dests[i];
+    
+            if (d->n_pooled == 0 && (victim == NULL || d->rate + d->count < victim->rate + victim->count)) {
+                victim = d;
+            }
+        }
+    
+        if (victim == NULL) {
+            return NULL;
+        }
+    }
+    
+    memset(victim, 0, sizeof(*victim));
+    memcpy(&victim->addr, addr, addr_len);
+    victim->addr_len = addr_len;
+    
+    return victim;
+}
+
+/**
+ * A pooled socket is usable while it is connecting or connected with
+ * nothing but (possibly) a server greeting to read.
+ */
+static int pooled_alive(int fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char c;
+    
+    if (poll(&pfd, 1, 0) == -1) {
+        return 0;
+    }
+    
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        return 0;
+    }
+    
+    if (pfd.revents & POLLIN) {
+        return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+    }
+    
+    return 1;
+}
+
+int sockspool_take(sockspool_t* p, const struct sockaddr* addr, socklen_t addr_len) {
+    pool_dest_t* d = dest_find(p, addr, addr_len);
+    
+    if (d == NULL) {
+        p->stats.misses++;
+        return -1;
+    }
+    
+    d->count++;
+    
+    if (p->window_end < p->next_due) {
+        p->next_due = p->window_end; // pick the demand up at the end of the window
+    }
+    
+    while (d->n_pooled > 0) {
+        int fd = d->fds[0];
+    
+        if (!pooled_alive(fd)) {
+            dest_failed(p, d, monotonic_usec());
+            dest_drop(p, d, 0);
+            continue;
+        }
+    
+        memmove(&d->fds[0], &d->fds[1], (d->n_pooled - 1) * sizeof(d->fds[0]));
+        memmove(&d->born[0], &d->born[1], (d->n_pooled - 1) * sizeof(d->born[0]));
+        d->n_pooled--;
+        p->n_pooled--;
+    
+        p->stats.hits++;
+        p->next_due = 0; // replace it soon
+    
+        return fd;
+    }
+    
+    p->stats.misses++;
+    
+    return -1;
+}
+
+static void update_rates(sockspool_t* p, uint64_t now) {
+    if (now < p->window_end) {
+        return;
+    }
+    
+    uint64_t idle_windows = (now - p->window_end) / POOL_RATE_WINDOW_USEC;
+    
+    for (int i = 0; i < p->n_dests; i++) {
+        pool_dest_t* d = &p->dests[i];
+    
+        d->rate = d->rate * 7 / 8 + (float)d->count / 8;
+        d->count = 0;
+    
+        for (uint64_t k = 0; k < idle_windows && k < 64 && d->rate > 0; k++) {
+            d->rate = d->rate * 7 / 8;
+        }
+    }
+    
+    p->window_end += (idle_windows + 1) * POOL_RATE_WINDOW_USEC;
+}
+
+static void drop_stale(sockspool_t* p, uint64_t now) {
+    uint64_t max_age = (uint64_t)p->config.max_age_ms * 1000;
+    
+    for (int i = 0; i < p->n_dests; i++) {
+        pool_dest_t* d = &p->dests[i];
+        int j = 0;
+    
+        while (j < d->n_pooled) {
+            if (now - d->born[j] >= max_age) {
+                p->stats.expired++;
+                dest_drop(p, d, j);
+            } else if (!pooled_alive(d->fds[j])) {
+                dest_failed(p, d, now);
+                dest_drop(p, d, j);
+            } else {
+                j++;
+            }
+        }
+    }
+}
+
+static int pool_connect(sockspool_t* p, pool_dest_t* d, uint64_t now) {
+    int fd = socket(d->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    
+    if (fd == -1) {
+        slogf_ratelimited(SLOG_WARN, "pool socket: %s\n", strerror(errno));
+        return 0;
+    }
+    
+    p->stats.opened++;
+    
+    if (connect(fd, (struct sockaddr*)&d->addr, d->addr_len) == -1 && errno != EINPROGRESS) {
+        slogf_ratelimited(SLOG_INFO, "pool connect: %s\n", strerror(errno));
+        WARN_IFM1(close(fd));
+        dest_failed(p, d, now);
+        return 0;
+    }
+    
+    d->fds[d->n_pooled] = fd;
+    d->born[d->n_pooled] = now;
+    d->n_pooled++;
+    p->n_pooled++;
+    
+    return 1;
+}
+
+static int rate_cmp(const void* a, const void* b) {
+    float ra = (*(pool_dest_t* const*)a)->rate;
+    float rb = (*(pool_dest_t* const*)b)->rate;
+    
+    return ra < rb ? 1 : ra > rb ? -1 : 0;
+}
+
+/**
+ * Hottest destinations first, each up to about a second of its requests.
+ */
+static int refill(sockspool_t* p, uint64_t now) {
+    pool_dest_t* hot[POOL_MAX_DESTS];
+    int n_hot = 0;
+    
+    for (int i = 0; i < p->n_dests; i++) {
+        if (p->dests[i].rate >= POOL_MIN_RATE && p->dests[i].backoff_until <= now) {
+            hot[n_hot++] = &p->dests[i];
+        }
+    }
+    
+    qsort(hot, n_hot, sizeof(hot[0]), rate_cmp);
+    
+    for (int i = 0; i < n_hot && p->n_pooled < p->config.max_sockets; i++) {
+        pool_dest_t* d = hot[i];
+        int target = (int)d->rate + 1;
+    
+        if (target > p->config.max_per_dest) {
+            target = p->config.max_per_dest;
+        }
+    
+        while (d->n_pooled < target && p->n_pooled < p->config.max_sockets) {
+            if (!pool_connect(p, d, now)) {
+                break;
+            }
+        }
+    }
+    
+    return n_hot;
+}
+
+void sockspool_maintain(sockspool_t* p) {
+    uint64_t now = monotonic_usec();
+    
+    if (now < p->next_due) {
+        return;
+    }
+    
+    update_rates(p, now);
+    drop_stale(p, now);
+    
+    if (refill(p, now) > 0 || p->n_pooled > 0) {
+        p->next_due = now + POOL_TICK_USEC;
+    } else {
+        p->next_due = UINT64_MAX;
+    }
+}
+
+uint64_t sockspool_next_deadline(sockspool_t* p) {
+    return p->next_due;
+}
+
+void sockspool_stats(sockspool_t* p, sockspool_stats_t* stats) {
+    *stats = p->stats;
+    stats->pooled = p->n_pooled;
+}
@@ -0,0 +1,91 @@
+/* 
+ * File:   sockspool.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Speculative pre-connect pool. Tracks how often each destination is
+ * requested and keeps a few fresh, unused outbound connections open to
+ * the hottest ones, so a matching CONNECT skips the handshake with the
+ * target. Not thread safe: a pool belongs to one server loop thread.
+ */
+
+#ifndef SOCKSPOOL_H
+#define	SOCKSPOOL_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct sockspool;
+typedef struct sockspool sockspool_t;
+
+typedef struct sockspool_config {
+    /**
+     * pooled sockets over all destinations
+     */
+    int max_sockets;
+
+    /**
+     * pooled sockets per destination, at most SOCKSPOOL_MAX_PER_DEST
+     */
+    int max_per_dest;
+
+    /**
+     * unused sockets are closed after this, keep it below the idle
+     * timeout of the targets
+     */
+    int max_age_ms;
+} sockspool_config_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+
+    /**
+     * pre-connects started
+     */
+    uint64_t opened;
+
+    /**
+     * waste: closed unused because of age, or because the connect failed
+     * or the target closed them while pooled
+     */
+    uint64_t expired;
+    uint64_t failed;
+
+    int pooled;
+} sockspool_stats_t;
+
+#define SOCKSPOOL_MAX_PER_DEST 8
+
+sockspool_t* sockspool_new(const sockspool_config_t* config);
+void sockspool_free(sockspool_t* p);
+
+/**
+ * Counts a connect to addr and hands out a pooled socket for it, or -1.
+ * The socket is non-blocking and may still be connecting.
+ */
+int sockspool_take(sockspool_t* p, const struct sockaddr* addr, socklen_t addr_len);
+
+/**
+ * Updates the destination rates, drops stale sockets and tops the pool
+ * up, when due.
+ */
+void sockspool_maintain(sockspool_t* p);
+
+/**
+ * Next time sockspool_maintain() has work (CLOCK_MONOTONIC, usec),
+ * UINT64_MAX when the pool is idle.
+ */
+uint64_t sockspool_next_deadline(sockspool_t* p);
+
+void sockspool_stats(sockspool_t* p, sockspool_stats_t* stats);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSPOOL_H */
+
@@ -11,26 +11,49 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #ifdef STATIC_ANL
 #include <anl.h>
 #endif
 
-#include <debuglogs.h>
 #include <errorfc.h>
 #include <bufs.h>
 
 #include "socksserver.h"
+#include "sockstrace.h"
+#include "sockslog.h"
+#include "sockstls.h"
+#include "socksbpf.h"
+#include "sockspool.h"
+#include "socksauth.h"
+#include "sockstune.h"
+#include "socksbreaker.h"
+#include "socksclock.h"
+
+/**
+ * errorfc.h counterparts for per-connection calls: peer resets and the
+ * like are logged asynchronously and rate-limited instead of perror()ed.
+ */
+#define SLOG_IFM1(level, x) do { if ((x) == -1) { slogf_ratelimited((level), "%s: %s\n", #x, strerror(errno)); } } while (0)
+#define SLOGFAIL_IFM1(level, x) do { if ((x) == -1) { slogf_ratelimited((level), "%s: %s\n", #x, strerror(errno)); goto fail; } } while (0)
 
 static ssize_t send_nosignal(int fd, const void *buf, size_t n) {
     ssize_t tw = 0;
     
     while (n > 0) {
         ssize_t nw = send(fd, buf, n, MSG_NOSIGNAL);
-        
+    
         if (nw <= 0) {
             return nw == -1 && tw == 0 ? (ssize_t)-1 : tw;
         }
-        
+    
         tw += nw;
         buf += nw;
         n -= nw;
@@ -41,22 +64,77 @@ static ssize_t send_nosignal(int fd, const void *buf, size_t n) {
 
 #define DEF_SOCKET_READ_TIMEOUT 300
 
+/**
+ * Time an offloaded tunnel is kept open after EOF so that skbs the kernel
+ * already redirected leave the peer socket before it is closed.
+ */
+#define SOCKMAP_DRAIN_USEC 200000
+#define SOCKMAP_MAX_SOCKETS 65536
+
+/**
+ * Embedding mode: events taken per epoll_wait() and the epoll data of the
+ * listener and the eventfd signalled when a name lookup or a password
+ * check finishes; connections are tagged by pointer,
+ * with EPTAG_TUNNEL set for their tunnel socket.
+ */
+#define EPOLL_BATCH 64
+#define EPTAG_LISTENER 0
+#define EPTAG_RESOLVER 1
+#define EPTAG_TUNNEL 2
+
+/**
+ * Relay scheduling: each round a connection may move SCHED_QUANTUM bytes
+ * per direction in SCHED_CHUNK sized reads (deficit round-robin, an
+ * overshoot is carried as debt), the rest waits for the next round.
+ */
+#define SCHED_CHUNK 4096
+#define SCHED_QUANTUM 8192
+
+#define CONNEV_S_READ 1
+#define CONNEV_S_WRITE 2
+#define CONNEV_TS_READ 4
+#define CONNEV_TS_WRITE 8
+#define CONNEV_TS_EXCEPT 16
+
 #define PROXYPROTO_HTTP 1
 #define PROXYPROTO_CONNECT 2
 #define PROXYPROTO_SOCKS4 4
 #define PROXYPROTO_SOCKS5 5
 
+#define CONNSTAGE_ECHO -2
+#define CONNSTAGE_FAIL -1
+#define CONNSTAGE_INIT 0
+#define CONNSTAGE_CONNECTED 1
+#define CONNSTAGE_SOCK5AUTH 51
+#define CONNSTAGE_AUTH_INPROGRESS 58
+#define CONNSTAGE_SOCK5SRECVCMD 52
+#define CONNSTAGE_SOCK5RESOLUTION 53
+#define CONNSTAGE_SOCK5RESOLUTION_INPROGRESS 54
+#define CONNSTAGE_SOCK5RESOLUTIONFAIL -53
+#define CONNSTAGE_SOCK5CONNECT 55
+#define CONNSTAGE_SOCK5CONNECTING 56
+#define CONNSTAGE_SOCK5CONNECTED 57
+#define CONNSTAGE_SOCK5CONNECTFAIL -52
+#define CONNSTAGE_SOCK4RECVCMD 42
+#define CONNSTAGE_HTTPRECVHDR 80
+#define CONNSTAGE_TLSHANDSHAKE 90
+#define CONNSTAGE_SOCKMAPDRAIN 2
+
 struct resolverstate;
 typedef struct resolverstate resolverstate_t;
 
 struct socks_server_connection {
+    uint32_t id;
+    
+    socks_server_t* server;
+    
     int s, ts;
     
     time_t s_last, ts_last;
     
     int ts_connecting;
     
-    struct sockaddr * addr;
+    struct sockaddr_storage addr;
     socklen_t addr_len;
     
     unsigned char resolve_hostname[256];
@@ -68,11 +146,77 @@ struct socks_server_connection {
     int stage;
     buf_t s_buf;
     
+    /**
+     * relayed data the receiving leg did not take yet, up_buf for the
+     * tunnel and down_buf for the client; the other leg is not read while
+     * a buffer holds data
+     */
+    buf_t up_buf, down_buf;
+    
     int protocol;
-
+    
+    int first_byte_seen;
+    
+    sockstls_conn_t* tls;
+    int tls_want_write;
+    int ktls_send;
+    
+    int offloaded;
+    uint64_t drain_until;
+    
+    /**
+     * sockmap tunnels: bytes read off each leg according to the kernel
+     * and the totals accounted by the loop, at the last settlement
+     */
+    int offload_counted;
+    uint64_t offload_read_s, offload_read_ts;
+    uint64_t offload_up, offload_down;
+    
+    /**
+     * identity verified by the credential store, NULL without auth
+     */
+    socksauth_user_t* user;
+    
+    /**
+     * password check running on the store's helper threads
+     */
+    socksauth_check_t* auth_check;
+    
+    /**
+     * tuning profile the client socket has, NULL for none
+     */
+    const sockstune_profile_t* tune;
+    
+    /**
+     * circuit breaker keys checked for the pending connect attempt
+     * (BREAKER_HOST / BREAKER_ADDR) and when it started
+     */
+    int breaker_keys;
+    uint64_t breaker_start;
+    
+    uint64_t bytes_up, bytes_down;
+    
+    /**
+     * relay scheduling: credit per direction, the connection still has
+     * data after its quota, waiting since (usec, 0 when not waiting) and
+     * the longest wait for service
+     */
+    int32_t deficit_up, deficit_down;
+    int backlogged;
+    uint64_t wait_since, max_wait;
+    
+    /**
+     * embedding mode: events registered with epoll, events collected for
+     * the current batch
+     */
+    uint32_t ep_s, ep_ts;
+    int ready_events, ready_queued;
+    socks_server_connection_t* ready_next;
+    
     struct gaicb resolve_gaicb;
     struct gaicb* resolve_gaicb_ptr;
-
+    
+    socks_server_connection_t* prev;
     socks_server_connection_t* next;
 };
 
@@ -80,21 +224,177 @@ struct resolverstate {
     struct socks_server_connection* conn_ptr;
 };
 
+/**
+ * Lookup and password check completions are notified on threads of their
+ * own, which can run after the connection or the server is gone: each
+ * pending one holds a reference to the eventfd and the last one out
+ * closes it.
+ */
+struct resolve_notifier {
+    int efd;
+    int refs;
+};
+
+static void conn_set_stage(socks_server_connection_t * conn, int stage) {
+    conn->stage = stage;
+    sockstrace(stage, STAGE, conn->id, stage, 0);
+}
+
+static void conn_account(socks_server_connection_t * conn, size_t up, size_t down) {
+    socks_server_t* s = conn->server;
+    
+    conn->bytes_up += up;
+    conn->bytes_down += down;
+    
+    if (s->callbacks.bytes != NULL) {
+        s->callbacks.bytes(s->callbacks.closure, conn->id, up, down);
+    }
+}
+
+/**
+ * Deadlines only move later with activity, so keeping the earliest one
+ * seen is enough: an early sweep just finds nothing to do.
+ */
+static void server_deadline_update(socks_server_t * s, uint64_t deadline) {
+    if (deadline < s->next_deadline) {
+        s->next_deadline = deadline;
+    }
+}
+
+static uint64_t conn_timeout_deadline(socks_server_connection_t * conn) {
+    time_t last = conn->ts != -1 && conn->ts_last < conn->s_last ? conn->ts_last : conn->s_last;
+    time_t left = last + conn->server->socket_read_timeout + 1 - time(NULL);
+    
+    return monotonic_usec() + (left > 0 ? (uint64_t)left * 1000000 : 0);
+}
+
+/**
+ * Client side I/O goes through OpenSSL on TLS listeners. Sends bypass it
+ * when the kernel encrypts (kTLS); receives never do, alerts and
+ * post-handshake messages have to reach OpenSSL.
+ */
+static ssize_t client_recv(socks_server_connection_t * conn, void* buf, size_t len) {
+    if (conn->tls != NULL) {
+        return sockstls_recv(conn->tls, buf, len);
+    }
+    
+    return recv(conn->s, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/**
+ * An SSL_write() that wants the socket writable leaves the plaintext in
+ * down_buf, the retry from there passes the same bytes again.
+ */
+static ssize_t client_write(socks_server_connection_t * conn, const void* buf, size_t len) {
+    if (conn->tls != NULL && !conn->ktls_send) {
+        return sockstls_send(conn->tls, buf, len);
+    }
+    
+    return send(conn->s, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/**
+ * Sends to the client (to_client) or the tunnel without blocking, what
+ * the socket does not take is queued in the leg's buffer. Bytes written
+ * are charged to the direction's credit. Returns 0 on errors.
+ */
+static int relay_send(socks_server_connection_t * conn, int to_client, const void* buf, size_t len, int32_t* deficit) {
+    buf_t* pending = to_client ? &conn->down_buf : &conn->up_buf;
+    ssize_t nw = 0;
+    
+    if (buf_length(pending) == 0) {
+        nw = to_client ? client_write(conn, buf, len) : send(conn->ts, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    
+        if (nw == -1 && errno != EAGAIN) {
+            slogf_ratelimited(SLOG_INFO, "send: %s\n", strerror(errno));
+            return 0;
+        }
+        if (nw == -1) {
+            nw = 0;
+        }
+    }
+    
+    if (deficit != NULL) {
+        *deficit -= nw;
+    }
+    
+    return (size_t)nw == len || buf_append(pending, (const uint8_t*)buf + nw, len - nw);
+}
+
+/**
+ * Sends what the leg's buffer holds once its socket is writable.
+ */
+static int relay_flush(socks_server_connection_t * conn, int to_client, int32_t* deficit) {
+    buf_t* pending = to_client ? &conn->down_buf : &conn->up_buf;
+    size_t len = buf_length(pending);
+    
+    if (len == 0) {
+        return 1;
+    }
+    
+    ssize_t nw = to_client ? client_write(conn, pending->data, len) : send(conn->ts, pending->data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    
+    if (nw == -1 && errno == EAGAIN) {
+        return 1;
+    }
+    
+    if (nw <= 0) {
+        slogf_ratelimited(SLOG_INFO, "send: %s\n", strerror(errno));
+        return 0;
+    }
+    
+    if (deficit != NULL) {
+        *deficit -= nw;
+    }
+    
+    if ((size_t)nw < len) {
+        buf_shift(NULL, pending, nw);
+    } else {
+        buf_free(pending);
+        buf_initialize(pending);
+    }
+    
+    return 1;
+}
+
+static int client_send(socks_server_connection_t * conn, const void* buf, size_t len) {
+    return relay_send(conn, 1, buf, len, NULL);
+}
+
+static int client_pending(socks_server_connection_t * conn) {
+    return conn->tls != NULL && sockstls_pending(conn->tls) > 0;
+}
+
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define MAX_UPDATE(a,b) if((b)>(a)) { a = (b); }
 
 int socks_server_start(socks_server_t * s, struct sockaddr * addr, socklen_t addr_len) {
+    return socks_server_start_ex(s, addr, addr_len, 0);
+}
+
+int socks_server_start_ex(socks_server_t * s, struct sockaddr * addr, socklen_t addr_len, int flags) {
     if (addr == NULL) {
         return 0;
     }
-
+    
     memset(s, 0, sizeof(socks_server_t));
     s->s = -1;
+    s->cpu = -1;
+    s->epfd = -1;
+    s->resolve_efd = -1;
+    s->next_deadline = UINT64_MAX;
     
     s->socket_read_timeout = DEF_SOCKET_READ_TIMEOUT;
     
     WARNFAIL_IFM1(s->s = socket(addr->sa_family, SOCK_STREAM, 0));
     
+    int one = 1;
+    WARNFAIL_IFNZ(setsockopt(s->s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)));
+    
+    if (flags & SOCKS_SERVER_REUSEPORT) {
+        WARNFAIL_IFNZ(setsockopt(s->s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)));
+    }
+    
     if (addr->sa_family == AF_INET6) {
         int val = 1;
         WARNFAIL_IFNZ(setsockopt(s->s, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val)));
@@ -113,142 +413,365 @@ int socks_server_start(socks_server_t * s, struct sockaddr * addr, socklen_t add
     return 0;
 }
 
+/**
+ * Applies the low-latency socket options to an accepted or outbound socket.
+ */
+static void set_lowlatency_sockopts(socks_server_t * s, int sock) {
+#ifdef SO_BUSY_POLL
+    if (s->busy_poll_usec > 0 && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &s->busy_poll_usec, sizeof(s->busy_poll_usec)) == -1) {
+        slogf_ratelimited(SLOG_WARN, "SO_BUSY_POLL: %s\n", strerror(errno));
+    }
+#endif
+#ifdef SO_INCOMING_CPU
+    if (s->cpu >= 0 && setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &s->cpu, sizeof(s->cpu)) == -1) {
+        slogf_ratelimited(SLOG_WARN, "SO_INCOMING_CPU: %s\n", strerror(errno));
+    }
+#endif
+}
+
+int socks_server_set_lowlatency(socks_server_t * s, const socks_server_lowlatency_t * ll) {
+    s->cpu = ll->cpu;
+    s->busy_poll_usec = ll->busy_poll_usec;
+    s->spin_usec = ll->spin_usec;
+    
+    if (s->cpu >= 0) {
+        cpu_set_t set;
+    
+        CPU_ZERO(&set);
+        CPU_SET(s->cpu, &set);
+    
+        int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (r != 0) {
+            slogf(SLOG_WARN, "pthread_setaffinity_np(%d): %s\n", s->cpu, strerror(r));
+            return 0;
+        }
+    }
+    
+    // on the listener this steers connections received on the cpu's queue
+    // to this server when several share the port with SO_REUSEPORT
+    set_lowlatency_sockopts(s, s->s);
+    
+    return 1;
+}
+
 static int clients_connected = 0;
+static uint32_t conn_id_seq = 0;
 
-#define dumpcc() { debugf("Clients connected: %d\n", clients_connected); }
+#define dumpcc() { slogf(SLOG_DEBUG, "Clients connected: %d\n", __atomic_load_n(&clients_connected, __ATOMIC_RELAXED)); }
 
-static void handle_new_socket(socks_server_t * s, int sock, struct sockaddr * addr, socklen_t addr_len) {
+static socks_server_connection_t* handle_new_socket(socks_server_t * s, int sock, struct sockaddr * addr, socklen_t addr_len) {
     if (s->peer_filter != NULL && !s->peer_filter(s->peer_filter_closure, addr, addr_len)) {
-        WARN_IFM1(send_nosignal(sock, "\x05\xff", 2));
-        WARN_IFM1(close(sock));
-        return;
+        if (s->tls == NULL) {
+            SLOG_IFM1(SLOG_INFO, send_nosignal(sock, "\x05\xff", 2));
+        }
+        SLOG_IFM1(SLOG_WARN, close(sock));
+        return NULL;
     }
     
     socks_server_connection_t* conn = calloc(1, sizeof(socks_server_connection_t));
     
+    if (conn == NULL) {
+        slogf_ratelimited(SLOG_WARN, "calloc: %s\n", strerror(errno));
+        goto fail;
+    }
+    
     buf_initialize(&conn->s_buf);
+    buf_initialize(&conn->up_buf);
+    buf_initialize(&conn->down_buf);
     
-    conn->next = s->cc;
-    s->cc = conn;
+    // oldest first, the round-robin cursor gives everyone a turn at the front
+    conn->prev = s->cc_tail;
+    if (s->cc_tail != NULL) {
+        s->cc_tail->next = conn;
+    } else {
+        s->cc = conn;
+    }
+    s->cc_tail = conn;
+    s->n_cc++;
     
+    conn->id = __atomic_add_fetch(&conn_id_seq, 1, __ATOMIC_RELAXED);
+    conn->server = s;
     conn->s = sock;
     conn->ts = -1;
     
     conn->s_last = time(NULL);
     
-    conn->addr = addr;
+    memcpy(&conn->addr, addr, addr_len);
     conn->addr_len = addr_len;
     
     conn->resolve_gaicb.ar_result = NULL;
     conn->resolve_gaicb_ptr = &conn->resolve_gaicb;
     
-    clients_connected++;
-    dumpcc();
-}
-
-static int send_data(int sock, uint8_t* buf, size_t len) {
-    uint8_t* buf_ptr = buf;
-    size_t remainder = len;
-
-    while (remainder > 0) {
-        int nw;
-        WARN_IFM1(nw = send_nosignal(sock, buf_ptr, remainder));
-
-        if (nw <= 0) {
-            return 0;
+    sockstrace(accept, ACCEPT, conn->id, conn->stage, sock);
+    
+    set_lowlatency_sockopts(s, sock);
+    
+    if (s->tune != NULL) {
+        conn->tune = s->tune_listener;
+    
+        // the listener's options were inherited, only a source rule changes them
+        const sockstune_profile_t* p = sockstune_match_source(s->tune, addr);
+    
+        if (p != NULL && p != conn->tune) {
+            sockstune_apply(p, sock);
+            conn->tune = p;
         }
-
-        buf_ptr += nw;
-        remainder -= nw;
     }
     
-    return 1;
+    int fl;
+    
+    // a client that stops reading must only hold up its own tunnel
+    if ((fl = fcntl(sock, F_GETFL, 0)) == -1 || fcntl(sock, F_SETFL, fl | O_NONBLOCK) == -1) {
+        conn_set_stage(conn, CONNSTAGE_FAIL);
+    } else if (s->tls != NULL) {
+        if ((conn->tls = sockstls_conn_new(s->tls, sock)) == NULL) {
+            conn_set_stage(conn, CONNSTAGE_FAIL);
+        } else {
+            conn_set_stage(conn, CONNSTAGE_TLSHANDSHAKE);
+        }
+    }
+    
+    __atomic_add_fetch(&clients_connected, 1, __ATOMIC_RELAXED);
+    dumpcc();
+    
+    server_deadline_update(s, conn_timeout_deadline(conn));
+    
+    if (s->callbacks.open != NULL) {
+        s->callbacks.open(s->callbacks.closure, conn->id, addr, addr_len);
+    }
+    
+    return conn;
+    
+    CATCH;
+    
+    SLOG_IFM1(SLOG_WARN, close(sock));
+    
+    return NULL;
 }
 
-static int forward_data(int sfrom, int sto) {
+static int echo_data(socks_server_connection_t * conn) {
     uint8_t buf[2048];
-
-    int nr = recv(sfrom, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
     
-    WARN_IFM1(nr);
+    ssize_t nr = client_recv(conn, buf, sizeof(buf));
+    
+    if (nr == -1 && errno == EAGAIN) {
+        return 1;
+    }
+    
+    if (nr == -1) {
+        slogf_ratelimited(SLOG_INFO, "recv: %s\n", strerror(errno));
+    }
     
     if (nr <= 0) {
         return 0;
     }
     
-    return send_data(sto, buf, nr);
+    return client_send(conn, buf, nr);
 }
 
-static int buffer_data(int sock, buf_t* buffer) {
-    uint8_t buf[2048];
+/**
+ * Called with the direction's credit spent: the connection keeps its
+ * place and is served again next round.
+ */
+static int sched_quota_exhausted(socks_server_connection_t * conn) {
+    conn->backlogged = 1;
+    conn->server->sched_preemptions++;
+    
+    return 1;
+}
 
-    int nr = recv(sock, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
+static int forward_to_client(socks_server_connection_t * conn) {
+    uint8_t buf[SCHED_CHUNK];
     
-    WARN_IFM1(nr);
+    conn->deficit_down += SCHED_QUANTUM;
     
-    if (nr <= 0) {
-        return 0;
+    while (conn->deficit_down > 0 && buf_length(&conn->down_buf) == 0) {
+        ssize_t nr = recv(conn->ts, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
+    
+        if (nr == -1 && errno == EAGAIN) {
+            conn->deficit_down = 0;
+            return 1;
+        }
+    
+        if (nr == -1) {
+            slogf_ratelimited(SLOG_INFO, "recv: %s\n", strerror(errno));
+        }
+    
+        if (nr <= 0) {
+            return 0;
+        }
+    
+        conn_account(conn, 0, nr);
+    
+        if (!relay_send(conn, 1, buf, nr, &conn->deficit_down)) {
+            return 0;
+        }
+    
+        if (nr < sizeof(buf)) { // drained, a level-triggered wait reports more
+            conn->deficit_down = 0;
+            return 1;
+        }
     }
     
-    return buf_append(buffer, buf, nr);
-}
-
-static int flush_buffer(int sock, buf_t* buffer) {
-    if (buffer->size == 0) {
+    if (buf_length(&conn->down_buf) > 0) { // waits for the client, not for a round
+        conn->deficit_down = 0;
         return 1;
     }
     
-    uint8_t* ptr = buffer->data;
-    size_t rem = buffer->size;
+    return sched_quota_exhausted(conn);
+}
+
+static int forward_to_tunnel(socks_server_connection_t * conn) {
+    uint8_t buf[SCHED_CHUNK];
+    
+    conn->deficit_up += SCHED_QUANTUM;
+    
+    // decrypted TLS data is invisible to the poller, it never waits for a round
+    while ((conn->deficit_up > 0 || client_pending(conn)) && buf_length(&conn->up_buf) == 0) {
+        ssize_t nr = client_recv(conn, buf, sizeof(buf));
+    
+        if (nr == -1 && errno == EAGAIN) {
+            conn->deficit_up = 0;
+            return 1;
+        }
     
-    while (rem >= 0) {
-        int nw = send_nosignal(sock, ptr, rem);
-        
-        WARN_IFM1(nw);
+        if (nr == -1) {
+            slogf_ratelimited(SLOG_INFO, "recv: %s\n", strerror(errno));
+        }
     
-        if (nw < 0) {
-            buf_shift(NULL, buffer, buffer->size - rem);
+        if (nr <= 0 || !relay_send(conn, 0, buf, nr, &conn->deficit_up)) {
             return 0;
         }
-        
-        ptr += nw;
-        rem -= nw;
+    
+        conn_account(conn, nr, 0);
+    
+        if (nr < sizeof(buf) && !client_pending(conn)) {
+            conn->deficit_up = 0;
+            return 1;
+        }
+    }
+    
+    if (buf_length(&conn->up_buf) > 0) { // waits for the tunnel, not for a round
+        conn->deficit_up = 0;
+        return 1;
     }
     
-    buf_free(buffer);
-    buf_initialize(buffer);
+    return sched_quota_exhausted(conn);
+}
+
+static int buffer_data(socks_server_connection_t * conn, buf_t* buffer) {
+    uint8_t buf[2048];
+    
+    do {
+        ssize_t nr = client_recv(conn, buf, sizeof(buf));
+    
+        if (nr == -1 && errno == EAGAIN) {
+            return 1;
+        }
+    
+        if (nr == -1) {
+            slogf_ratelimited(SLOG_INFO, "recv: %s\n", strerror(errno));
+        }
+    
+        if (nr <= 0 || !buf_append(buffer, buf, nr)) {
+            return 0;
+        }
+    } while (client_pending(conn));
     
     return 1;
 }
 
-#define CONNSTAGE_ECHO -2
-#define CONNSTAGE_FAIL -1
-#define CONNSTAGE_INIT 0
-#define CONNSTAGE_CONNECTED 1
-#define CONNSTAGE_SOCK5SRECVCMD 52
-#define CONNSTAGE_SOCK5RESOLUTION 53
-#define CONNSTAGE_SOCK5RESOLUTION_INPROGRESS 54
-#define CONNSTAGE_SOCK5RESOLUTIONFAIL -53
-#define CONNSTAGE_SOCK5CONNECT 55
-#define CONNSTAGE_SOCK5CONNECTING 56
-#define CONNSTAGE_SOCK5CONNECTED 57
-#define CONNSTAGE_SOCK5CONNECTFAIL -52
+#define SOCKS5REP_SUCCEEDED 0
+#define SOCKS5REP_GENERALFAIL 1
+#define SOCKS5REP_NOTALLOWED 2
+#define SOCKS5REP_HOSTUNREACH 4
+#define SOCKS5REP_REFUSED 5
+#define SOCKS5REP_CMDUNSUPPORTED 7
+#define SOCKS5REP_ATYPUNSUPPORTED 8
+
+#define HTTP_MAX_HEADER_SIZE 8192
+
+#define SOCKS5METHOD_NOAUTH 0
+#define SOCKS5METHOD_USERPASS 2
+
+#define HTTP_407 "HTTP/1.1 407 Proxy Authentication Required\r\nProxy-Authenticate: Basic realm=\"simplesocks\"\r\n" \
+        "Content-Length: 0\r\nConnection: close\r\n\r\n"
+
+/**
+ * Sends the CONNECT reply in the dialect of the connection's protocol.
+ * rep is a SOCKS5 reply code, mapped for SOCKS4 and HTTP clients.
+ */
+static int send_reply(socks_server_connection_t * conn, int rep) {
+    const char* msg;
+    size_t len;
+    char socks5[10] = { 5, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+    char socks4[8] = { 0, 0x5a, 0, 0, 0, 0, 0, 0 };
+    
+    switch (conn->protocol) {
+        case PROXYPROTO_SOCKS4:
+            socks4[1] = rep == SOCKS5REP_SUCCEEDED ? 0x5a : 0x5b;
+            msg = socks4;
+            len = sizeof(socks4);
+            break;
+        case PROXYPROTO_HTTP:
+        case PROXYPROTO_CONNECT:
+            if (rep == SOCKS5REP_SUCCEEDED) {
+                msg = "HTTP/1.1 200 Connection established\r\n\r\n";
+            } else if (rep == SOCKS5REP_NOTALLOWED) {
+                msg = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            } else if (rep == SOCKS5REP_CMDUNSUPPORTED) {
+                msg = "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            } else if (rep == SOCKS5REP_ATYPUNSUPPORTED) {
+                msg = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            } else {
+                msg = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            }
+            len = strlen(msg);
+            break;
+        default:
+            socks5[1] = rep;
+            msg = socks5;
+            len = sizeof(socks5);
+            break;
+    }
+    
+    return client_send(conn, msg, len);
+}
+
+#define BREAKER_HOST 1
+#define BREAKER_ADDR 2
+
+/**
+ * Tells the breaker how the pending connect attempt ended.
+ */
+static void breaker_report(socks_server_connection_t * conn, int outcome) {
+    if (conn->breaker_keys == 0) {
+        return;
+    }
+    
+    socksbreaker_report(conn->server->breaker,
+            conn->breaker_keys & BREAKER_HOST ? (const char*)conn->resolve_hostname : NULL, conn->resolve_port,
+            conn->breaker_keys & BREAKER_ADDR ? (struct sockaddr *)&conn->connect_addr : NULL,
+            outcome, monotonic_usec() - conn->breaker_start);
+    
+    conn->breaker_keys = 0;
+}
 
 static void setconnectaddr(socks_server_connection_t * conn, struct addrinfo* result) {
     struct sockaddr_in* addr4 = NULL;
     struct sockaddr_in6* addr6 = NULL;
-
+    
     if (result->ai_family == AF_INET) {
         conn->connect_addr.ss_family = AF_INET;
         conn->connect_addr_len = sizeof(struct sockaddr_in);
-
+    
         addr4 = (struct sockaddr_in *)&conn->connect_addr;
         memcpy(&conn->connect_addr, result->ai_addr, result->ai_addrlen);
         addr4->sin_port = htons(conn->resolve_port);
     } else if (result->ai_family == AF_INET6) {
         conn->connect_addr.ss_family = AF_INET6;
         conn->connect_addr_len = sizeof(struct sockaddr_in6);
-
+    
         addr6 = (struct sockaddr_in6*)&conn->connect_addr;
         memcpy(&conn->connect_addr, result->ai_addr, result->ai_addrlen);
         addr6->sin6_port = htons(conn->resolve_port);
@@ -266,190 +789,646 @@ static void resolve_addr_complete_ifready(socks_server_connection_t * conn) {
         return;
     }
     
+    sockstrace(resolve_done, RESOLVE_DONE, conn->id, conn->stage, r);
+    
     if (r == 0 || r == EAI_ALLDONE) {
         setconnectaddr(conn, conn->resolve_gaicb.ar_result);
-
+    
         freeaddrinfo(conn->resolve_gaicb.ar_result);
         conn->resolve_gaicb.ar_result = NULL;
-
-        conn->stage = CONNSTAGE_SOCK5CONNECT;
-        
+    
+        conn_set_stage(conn, CONNSTAGE_SOCK5CONNECT);
+    
         return;
     }
     
-    if (r == EAI_SYSTEM) {
-        perror("gai_error");
-    } else {
-        fprintf(stderr, "gai_error: %s\n", gai_strerror(r));
-    }
+    slogf_ratelimited(SLOG_INFO, "gai_error: %s\n", r == EAI_SYSTEM ? strerror(errno) : gai_strerror(r));
+    
+    breaker_report(conn, SOCKSBREAKER_FAILED);
     
     if (conn->resolve_gaicb.ar_result != NULL) {
         freeaddrinfo(conn->resolve_gaicb.ar_result);
         conn->resolve_gaicb.ar_result = NULL;
     }
-    conn->stage = CONNSTAGE_FAIL;
+    conn_set_stage(conn, CONNSTAGE_SOCK5RESOLUTIONFAIL);
+}
+
+static void resolve_notifier_release(struct resolve_notifier* n) {
+    if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        SLOG_IFM1(SLOG_WARN, close(n->efd));
+        free(n);
+    }
 }
 
-static void resolve_addr_cancel(socks_server_connection_t * conn) {
+/**
+ * Returns 0 when the lookup is already running: the resolver thread
+ * still owns the gaicb and the connection must outlive it.
+ */
+static int resolve_addr_cancel(socks_server_connection_t * conn) {
     if (conn->stage != CONNSTAGE_SOCK5RESOLUTION_INPROGRESS) {
-        return;
+        return 1;
+    }
+    
+    int r = gai_cancel(&conn->resolve_gaicb);
+    
+    if (r == EAI_NOTCANCELED || gai_error(&conn->resolve_gaicb) == EAI_INPROGRESS) {
+        return 0;
     }
     
-    gai_cancel(&conn->resolve_gaicb);
+    // a cancelled request is not notified
+    if (r == EAI_CANCELED && conn->server->resolve_notifier != NULL) {
+        resolve_notifier_release(conn->server->resolve_notifier);
+    }
     
     if (conn->resolve_gaicb.ar_result != NULL) {
         freeaddrinfo(conn->resolve_gaicb.ar_result);
+        conn->resolve_gaicb.ar_result = NULL;
     }
+    
+    return 1;
 }
 
-static void resolve_addr_start(socks_server_connection_t * conn) {
-    // (char *)conn->resolve_hostname, NULL, NULL, &result
+/**
+ * Frees the closed connections whose lookups have finished, waiting for
+ * all of them when wait is set.
+ */
+static void resolve_reap(socks_server_t * s, int wait) {
+    socks_server_connection_t** p = &s->cc_resolving;
     
-    memset(&conn->resolve_gaicb, 0, sizeof(conn->resolve_gaicb));
-
-    conn->resolve_gaicb.ar_name = (char *)conn->resolve_hostname;
-    conn->resolve_gaicb.ar_service = NULL;
-    conn->resolve_gaicb.ar_request = NULL;
+    while (*p != NULL) {
+        socks_server_connection_t* conn = *p;
     
-    int r;
+        while (wait && gai_error(&conn->resolve_gaicb) == EAI_INPROGRESS) {
+            const struct gaicb* list[1] = { &conn->resolve_gaicb };
     
-    conn->stage = CONNSTAGE_SOCK5RESOLUTION_INPROGRESS;
-
-    if ((r = getaddrinfo_a(GAI_NOWAIT, &conn->resolve_gaicb_ptr, 1, NULL)) != 0) {
-        if (r == EAI_ALLDONE) {
-            resolve_addr_complete_ifready(conn);
-            return;
+            gai_suspend(list, 1, NULL);
         }
-        
-        goto fail;
+    
+        if (gai_error(&conn->resolve_gaicb) == EAI_INPROGRESS) {
+            p = &conn->next;
+            continue;
+        }
+    
+        *p = conn->next;
+    
+        if (conn->resolve_gaicb.ar_result != NULL) {
+            freeaddrinfo(conn->resolve_gaicb.ar_result);
+        }
+        free(conn);
+    }
+}
+
+static void notifier_signal(struct resolve_notifier* n) {
+    uint64_t one = 1;
+    
+    SLOG_IFM1(SLOG_WARN, write(n->efd, &one, sizeof(one)));
+    
+    resolve_notifier_release(n);
+}
+
+static void resolve_notify(union sigval sv) {
+    notifier_signal(sv.sival_ptr);
+}
+
+static void resolve_addr_start(socks_server_connection_t * conn) {
+    // (char *)conn->resolve_hostname, NULL, NULL, &result
+    
+    // a host that keeps failing is refused before it costs a lookup
+    if (conn->server->breaker != NULL) {
+        if (!socksbreaker_allow(conn->server->breaker, (const char*)conn->resolve_hostname, conn->resolve_port, NULL)) {
+            slogf_ratelimited(SLOG_INFO, "Circuit open for %s\n", conn->resolve_hostname);
+            conn_set_stage(conn, CONNSTAGE_SOCK5RESOLUTIONFAIL);
+            return;
+        }
+    
+        conn->breaker_keys = BREAKER_HOST;
+        conn->breaker_start = monotonic_usec();
+    }
+    
+    memset(&conn->resolve_gaicb, 0, sizeof(conn->resolve_gaicb));
+    
+    conn->resolve_gaicb.ar_name = (char *)conn->resolve_hostname;
+    conn->resolve_gaicb.ar_service = NULL;
+    conn->resolve_gaicb.ar_request = NULL;
+    
+    int r;
+    
+    struct sigevent sev;
+    
+    // embedded servers are told about completions instead of polling
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = resolve_notify;
+    sev.sigev_value.sival_ptr = conn->server->resolve_notifier;
+    
+    conn_set_stage(conn, CONNSTAGE_SOCK5RESOLUTION_INPROGRESS);
+    sockstrace(resolve_start, RESOLVE_START, conn->id, conn->stage, 0);
+    
+    if (conn->server->resolve_notifier != NULL) {
+        __atomic_add_fetch(&conn->server->resolve_notifier->refs, 1, __ATOMIC_RELAXED);
+    }
+    
+    if ((r = getaddrinfo_a(GAI_NOWAIT, &conn->resolve_gaicb_ptr, 1, conn->server->resolve_notifier != NULL ? &sev : NULL)) != 0) {
+        if (conn->server->resolve_notifier != NULL) {
+            resolve_notifier_release(conn->server->resolve_notifier);
+        }
+    
+        if (r == EAI_ALLDONE) {
+            resolve_addr_complete_ifready(conn);
+            return;
+        }
+    
+        goto fail;
     }
- 
+    
     return;
     
     fail:
-    conn->stage = CONNSTAGE_SOCK5RESOLUTIONFAIL;
+    conn_set_stage(conn, CONNSTAGE_SOCK5RESOLUTIONFAIL);
+}
+
+/**
+ * A destination rule overrides the client's profile on both legs.
+ */
+static void tune_tunnel(socks_server_connection_t * conn) {
+    const sockstune_profile_t* p = sockstune_match_dest(conn->server->tune, (struct sockaddr *)&conn->connect_addr);
+    
+    if (p != NULL && p != conn->tune) {
+        sockstune_apply(p, conn->s);
+        conn->tune = p;
+    }
+    
+    if (conn->tune != NULL) {
+        sockstune_apply(conn->tune, conn->ts);
+    }
 }
 
 static void connect_addr(socks_server_connection_t * conn) {
-    WARNFAIL_IFM1(conn->ts = socket(conn->connect_addr.ss_family, SOCK_STREAM, 0));
+    if (conn->server->breaker != NULL) {
+        if (!socksbreaker_allow(conn->server->breaker, NULL, 0, (struct sockaddr *)&conn->connect_addr)) {
+            slogf_ratelimited(SLOG_INFO, "Circuit open for the destination address\n");
+            breaker_report(conn, SOCKSBREAKER_FAILED); // the host resolved to a dead address
+            conn_set_stage(conn, CONNSTAGE_SOCK5CONNECTFAIL);
+            return;
+        }
+    
+        if (conn->breaker_keys == 0) {
+            conn->breaker_start = monotonic_usec();
+        }
+        conn->breaker_keys |= BREAKER_ADDR;
+    }
+    
+    if (conn->server->pool != NULL) {
+        conn->ts = sockspool_take(conn->server->pool, (struct sockaddr *)&conn->connect_addr, conn->connect_addr_len);
+    
+        if (conn->ts != -1) {
+            sockstrace(connect_start, CONNECT_START, conn->id, conn->stage, 1);
+    
+            set_lowlatency_sockopts(conn->server, conn->ts);
+    
+            if (conn->server->tune != NULL) {
+                tune_tunnel(conn);
+            }
+    
+            // usually connected already, handle_write_ready() runs on the next wakeup
+            conn_set_stage(conn, CONNSTAGE_SOCK5CONNECTING);
+            conn->ts_last = time(NULL);
+    
+            slogf(SLOG_DEBUG, "Connecting (pooled)\n");
+    
+            return;
+        }
+    }
+    
+    sockstrace(connect_start, CONNECT_START, conn->id, conn->stage, 0);
+    
+    SLOGFAIL_IFM1(SLOG_WARN, conn->ts = socket(conn->connect_addr.ss_family, SOCK_STREAM, 0));
+    
+    set_lowlatency_sockopts(conn->server, conn->ts);
+    
+    // before connect(), the buffer sizes decide the window scale offered
+    if (conn->server->tune != NULL) {
+        tune_tunnel(conn);
+    }
     
     int fl;
-    WARNFAIL_IFM1(fl = fcntl(conn->ts, F_GETFL, 0));
-    WARNFAIL_IFM1(fcntl(conn->ts, F_SETFL, fl | O_NONBLOCK));
+    SLOGFAIL_IFM1(SLOG_WARN, fl = fcntl(conn->ts, F_GETFL, 0));
+    SLOGFAIL_IFM1(SLOG_WARN, fcntl(conn->ts, F_SETFL, fl | O_NONBLOCK));
     
     if (connect(conn->ts, (struct sockaddr *)&conn->connect_addr, conn->connect_addr_len) == -1) {
         if (errno != EINPROGRESS) {
-            perror("connect");
+            slogf_ratelimited(SLOG_INFO, "connect: %s\n", strerror(errno));
+            breaker_report(conn, SOCKSBREAKER_FAILED);
             goto fail;
         }
     }
     
-    conn->stage = CONNSTAGE_SOCK5CONNECTING;
+    conn_set_stage(conn, CONNSTAGE_SOCK5CONNECTING);
     conn->ts_last = time(NULL);
     
-    debugf("Connecting\n");
-
+    slogf(SLOG_DEBUG, "Connecting\n");
+    
     return;
     
     CATCH;
     
-    debugf("Connection failed\n");
+    slogf_ratelimited(SLOG_INFO, "Connection failed\n");
     
     if (conn->ts != -1) {
-        WARN_IFM1(close(conn->ts));
+        SLOG_IFM1(SLOG_WARN, close(conn->ts));
         conn->ts = -1;
     }
     
-    conn->stage = CONNSTAGE_SOCK5CONNECTFAIL;
+    conn_set_stage(conn, CONNSTAGE_SOCK5CONNECTFAIL);
 }
 
-static int handle_received_data(socks_server_connection_t * conn, int from_client, int from_tunnel) {
+static void auth_notify(void* arg) {
+    notifier_signal(arg);
+}
+
+/**
+ * Embedded servers learn about finished password checks through the
+ * lookup eventfd, select() loops poll them in conn_advance().
+ */
+static struct resolve_notifier* auth_notifier_ref(socks_server_t * s) {
+    if (s->resolve_notifier != NULL) {
+        __atomic_add_fetch(&s->resolve_notifier->refs, 1, __ATOMIC_RELAXED);
+    }
+    
+    return s->resolve_notifier;
+}
+
+/**
+ * Waits for the check a parser started, 0 when it could not be started.
+ */
+static int auth_wait(socks_server_connection_t * conn, socksauth_check_t* check, struct resolve_notifier* n) {
+    if (check == NULL) {
+        if (n != NULL) {
+            resolve_notifier_release(n);
+        }
+        return 0;
+    }
+    
+    conn->auth_check = check;
+    conn_set_stage(conn, CONNSTAGE_AUTH_INPROGRESS);
+    
+    return 1;
+}
+
+static void conn_authenticated(socks_server_connection_t * conn, socksauth_user_t* user) {
+    socks_server_t* s = conn->server;
+    
+    conn->user = user;
+    __atomic_add_fetch(&user->connections, 1, __ATOMIC_RELAXED);
+    
+    slogf(SLOG_DEBUG, "Authenticated as %s\n", user->name);
+    
+    if (s->callbacks.authenticated != NULL) {
+        s->callbacks.authenticated(s->callbacks.closure, conn->id, user->name);
+    }
+}
+
+/**
+ * RFC 1929 username/password subnegotiation:
+ * VER(1) ULEN(1) UNAME PLEN(1) PASSWD
+ */
+static int parse_socks5_auth(socks_server_connection_t * conn) {
+    uint8_t* b = conn->s_buf.data;
+    size_t len = buf_length(&conn->s_buf);
+    
+    if (len < 2 || len < 3 + b[1] || len < 3 + b[1] + b[2 + b[1]]) {
+        return 1; // more data required
+    }
+    
+    size_t ulen = b[1];
+    size_t plen = b[2 + ulen];
+    
+    if (b[0] != 1) {
+        slogf_ratelimited(SLOG_INFO, "Bad auth version: %d\n", b[0]);
+        return 0;
+    }
+    
+    struct resolve_notifier* n = auth_notifier_ref(conn->server);
+    socksauth_check_t* check = socksauth_verify_start(conn->server->auth, (char*)b + 2, ulen, (char*)b + 3 + ulen, plen,
+            n != NULL ? auth_notify : NULL, n);
+    
+    memset(b, 0, 3 + ulen + plen);
+    buf_shift(NULL, &conn->s_buf, 3 + ulen + plen);
+    
+    if (!auth_wait(conn, check, n)) {
+        slogf_ratelimited(SLOG_INFO, "Authentication failed\n");
+        client_send(conn, "\x01\x01", 2);
+        return 0;
+    }
+    
+    return 1;
+}
+
+/**
+ * HTTP "Proxy-Authorization: Basic <token>", answers 407 when it is
+ * missing; the token is checked on the way to resolution.
+ */
+static int check_http_auth(socks_server_connection_t * conn, const char* hdr) {
+    const char* field = strcasestr(hdr, "\r\nProxy-Authorization:");
+    socksauth_check_t* check = NULL;
+    struct resolve_notifier* n = NULL;
+    
+    if (field != NULL) {
+        const char* v = field + 22;
+    
+        v += strspn(v, " \t");
+        if (strncasecmp(v, "Basic", 5) == 0) {
+            v += 5;
+            v += strspn(v, " \t");
+            n = auth_notifier_ref(conn->server);
+            check = socksauth_verify_basic_start(conn->server->auth, v, strcspn(v, " \t\r"), n != NULL ? auth_notify : NULL, n);
+        }
+    }
+    
+    if (!auth_wait(conn, check, n)) {
+        slogf_ratelimited(SLOG_INFO, "Authentication failed\n");
+        client_send(conn, HTTP_407, strlen(HTTP_407));
+        return 0;
+    }
+    
+    return 1;
+}
+
+/**
+ * SOCKS4 / SOCKS4a CONNECT request:
+ * VN(1) CD(1) DSTPORT(2) DSTIP(4) USERID NUL [HOSTNAME NUL]
+ */
+static int parse_socks4_request(socks_server_connection_t * conn) {
+    uint8_t* b = conn->s_buf.data;
+    size_t len = conn->s_buf.size;
+    
+    if (len < 9) {
+        return 1; // more data required
+    }
+    
+    uint8_t* userid_end = memchr(b + 8, 0, len - 8);
+    
+    if (userid_end == NULL) {
+        return len < 8 + 256 ? 1 : 0;
+    }
+    
+    if (conn->server->auth != NULL) { // the user id carries no password
+        slogf_ratelimited(SLOG_INFO, "SOCKS4 refused, authentication required\n");
+        send_reply(conn, SOCKS5REP_NOTALLOWED);
+        return 0;
+    }
+    
+    if (b[1] != 1) {
+        slogf_ratelimited(SLOG_INFO, "Unsupported SOCKS4 command: %d\n", b[1]);
+        send_reply(conn, SOCKS5REP_CMDUNSUPPORTED);
+        return 0;
+    }
+    
+    uint16_t port;
+    memcpy(&port, b + 2, 2);
+    
+    size_t ofs = userid_end + 1 - b;
+    
+    if (b[4] == 0 && b[5] == 0 && b[6] == 0 && b[7] != 0) { // SOCKS4a, hostname follows
+        uint8_t* host = userid_end + 1;
+        uint8_t* host_end = memchr(host, 0, len - ofs);
+    
+        if (host_end == NULL) {
+            return len - ofs < sizeof(conn->resolve_hostname) ? 1 : 0;
+        }
+    
+        if (host_end == host || host_end - host >= sizeof(conn->resolve_hostname)) {
+            slogf_ratelimited(SLOG_INFO, "Bad SOCKS4a hostname\n");
+            send_reply(conn, SOCKS5REP_ATYPUNSUPPORTED);
+            return 0;
+        }
+    
+        memcpy(conn->resolve_hostname, host, host_end - host + 1);
+        conn->resolve_port = ntohs(port);
+    
+        ofs = host_end + 1 - b;
+        conn_set_stage(conn, CONNSTAGE_SOCK5RESOLUTION);
+    } else {
+        struct sockaddr_in* addr4 = (struct sockaddr_in*)&conn->connect_addr;
+    
+        memset(addr4, 0, sizeof(struct sockaddr_in));
+        addr4->sin_family = AF_INET;
+        memcpy(&addr4->sin_addr, b + 4, 4);
+        addr4->sin_port = port;
+        conn->connect_addr_len = sizeof(struct sockaddr_in);
+    
+        conn_set_stage(conn, CONNSTAGE_SOCK5CONNECT);
+    }
+    
+    buf_shift(NULL, &conn->s_buf, ofs);
+    
+    return 1;
+}
+
+/**
+ * HTTP proxy request header: only "CONNECT host:port HTTP/1.x" is served,
+ * anything received after the header is relayed once the tunnel is up.
+ */
+static int parse_http_connect(socks_server_connection_t * conn) {
+    char* hdr = (char*)conn->s_buf.data;
+    char* hdr_end = memmem(hdr, conn->s_buf.size, "\r\n\r\n", 4);
+    
+    if (hdr_end == NULL) {
+        if (conn->s_buf.size > HTTP_MAX_HEADER_SIZE) {
+            slogf_ratelimited(SLOG_INFO, "HTTP header too large\n");
+            send_reply(conn, SOCKS5REP_ATYPUNSUPPORTED);
+            return 0;
+        }
+        return 1; // more data required
+    }
+    
+    size_t hdr_len = hdr_end + 4 - hdr;
+    *hdr_end = 0;
+    
+    if (strncmp(hdr, "CONNECT ", 8) != 0) {
+        slogf_ratelimited(SLOG_INFO, "Unsupported HTTP method\n");
+        send_reply(conn, SOCKS5REP_CMDUNSUPPORTED);
+        return 0;
+    }
+    
+    conn->protocol = PROXYPROTO_CONNECT;
+    
+    char* host = hdr + 8;
+    char* host_end;
+    char* port_str;
+    
+    if (*host == '[') { // IPv6 literal
+        host++;
+        host_end = strchr(host, ']');
+        port_str = host_end != NULL && host_end[1] == ':' ? host_end + 2 : NULL;
+    } else {
+        host_end = strpbrk(host, ": \r");
+        port_str = host_end != NULL && *host_end == ':' ? host_end + 1 : NULL;
+    }
+    
+    char* end = NULL;
+    long port = port_str != NULL ? strtol(port_str, &end, 10) : 0;
+    
+    if (port_str == NULL || end == port_str || *end != ' ' || port <= 0 || port > 65535
+            || host_end == host || host_end - host >= sizeof(conn->resolve_hostname)) {
+        slogf_ratelimited(SLOG_INFO, "Bad CONNECT authority\n");
+        send_reply(conn, SOCKS5REP_ATYPUNSUPPORTED);
+        return 0;
+    }
+    
+    memcpy(conn->resolve_hostname, host, host_end - host);
+    conn->resolve_hostname[host_end - host] = 0;
+    conn->resolve_port = port;
+    
+    conn_set_stage(conn, CONNSTAGE_SOCK5RESOLUTION);
+    
+    // the check copies the token, the header can go
+    if (conn->server->auth != NULL && !check_http_auth(conn, hdr)) {
+        return 0;
+    }
+    
+    buf_shift(NULL, &conn->s_buf, hdr_len);
+    
+    return 1;
+}
 
+static int handle_received_data(socks_server_connection_t * conn, int from_client, int from_tunnel) {
+    
     if (from_tunnel) {
         conn->ts_last = time(NULL);
-
-        if (!forward_data(conn->ts, conn->s)) {
+    
+        if (!conn->first_byte_seen) {
+            conn->first_byte_seen = 1;
+            sockstrace(first_byte, FIRST_BYTE, conn->id, conn->stage, 0);
+        }
+    
+        if (!forward_to_client(conn)) {
             return 0;
         }
     }
     
     if (from_client) {
         conn->s_last = time(NULL);
-
+    
         if (conn->ts != -1) {
-            if (!forward_data(conn->s, conn->ts)) {
+            if (!forward_to_tunnel(conn)) {
                 return 0;
             }
         } else {
-            if (!buffer_data(conn->s, &conn->s_buf)) {
+            if (!buffer_data(conn, &conn->s_buf)) {
                 return 0;
             }
             if (!buf_terminatezero(&conn->s_buf)) {
-                debugf("z fail\n");
+                slogf(SLOG_ERROR, "z fail\n");
                 return 0;
             }
-
+    
             if (conn->stage == CONNSTAGE_INIT) {
-                
+    
                 if (buf_length(&conn->s_buf) == 0) {
                     return 1;
                 }
-                
+    
                 if (conn->protocol == 0) {
-                    if (conn->s_buf.data[0] == 4) {
-                        debugf("SOCKS4 not supported");
-                        return 0; // socks 4 not supported
-                    } else if (conn->s_buf.data[0] == 5) {
+                    uint8_t first = conn->s_buf.data[0];
+    
+                    if (first == 4) {
+                        conn->protocol = PROXYPROTO_SOCKS4;
+                        conn_set_stage(conn, CONNSTAGE_SOCK4RECVCMD);
+                    } else if (first == 5) {
                         conn->protocol = PROXYPROTO_SOCKS5;
+                    } else if (first >= 'A' && first <= 'Z') { // HTTP verb
+                        conn->protocol = PROXYPROTO_HTTP;
+                        conn_set_stage(conn, CONNSTAGE_HTTPRECVHDR);
                     } else {
-                        debugf("unsupported protocol %d\n", conn->s_buf.data[0]);
+                        slogf_ratelimited(SLOG_INFO, "unsupported protocol %d\n", first);
                         return 0;
                     }
                 }
-                
-                // socks5 only here
+            }
+    
+            if (conn->stage == CONNSTAGE_INIT) { // socks5 method negotiation
+                if (buf_length(&conn->s_buf) < 2) {
+                    return 1;
+                }
+    
                 int n_methods = conn->s_buf.data[1];
                 size_t ofs = 2 + n_methods;
-                
-                if (!buf_shift(NULL, &conn->s_buf, ofs)) {
+    
+                if (buf_length(&conn->s_buf) < ofs) {
                     return 1; // not enough input data, receive more data
                 }
-                
-                send_data(conn->s, (uint8_t*)"\x05\x00", 2); // TODO : auth support
-                
-                conn->stage = CONNSTAGE_SOCK5SRECVCMD;
-                
+    
+                if (conn->server->auth != NULL) {
+                    int offered = memchr(conn->s_buf.data + 2, SOCKS5METHOD_USERPASS, n_methods) != NULL;
+    
+                    buf_shift(NULL, &conn->s_buf, ofs);
+    
+                    if (!offered) {
+                        slogf_ratelimited(SLOG_INFO, "Client offers no username/password auth\n");
+                        client_send(conn, "\x05\xff", 2);
+                        return 0;
+                    }
+    
+                    client_send(conn, "\x05\x02", 2);
+    
+                    conn_set_stage(conn, CONNSTAGE_SOCK5AUTH);
+                } else {
+                    buf_shift(NULL, &conn->s_buf, ofs);
+    
+                    client_send(conn, "\x05\x00", 2);
+    
+                    conn_set_stage(conn, CONNSTAGE_SOCK5SRECVCMD);
+                }
+            }
+    
+            if (conn->stage == CONNSTAGE_SOCK5AUTH) {
+                if (!parse_socks5_auth(conn)) {
+                    return 0;
+                }
+            }
+    
+            if (conn->stage == CONNSTAGE_SOCK4RECVCMD) {
+                if (!parse_socks4_request(conn)) {
+                    return 0;
+                }
+            }
+    
+            if (conn->stage == CONNSTAGE_HTTPRECVHDR) {
+                if (!parse_http_connect(conn)) {
+                    return 0;
+                }
             }
-            
+    
             if (conn->stage == CONNSTAGE_SOCK5SRECVCMD && conn->s_buf.size >= 10) { // socks5 / Once the method-dependent subnegotiation has completed
                 uint8_t* b = conn->s_buf.data;
-                
+    
                 if (*b != 5) {
-                    debugf("Bad socks version: %d\n", *b);
+                    slogf_ratelimited(SLOG_INFO, "Bad socks version: %d\n", *b);
                     return 0;
                 }
                 b++;
-                
+    
                 if (*b != 1) {
-                    debugf("Unsupported command: %d\n", *b);
+                    slogf_ratelimited(SLOG_INFO, "Unsupported command: %d\n", *b);
                     return 0;
                 }
                 b++;
-                
+    
                 if (*b != 0) {
-                    debugf("Bad reserved field value: %d\n", *b);
+                    slogf_ratelimited(SLOG_INFO, "Bad reserved field value: %d\n", *b);
                     return 0;
                 }
                 b++;
-                
+    
                 int atyp = *b;
                 b++;
-                
+    
                 struct sockaddr_in* addr4 = NULL;
                 struct sockaddr_in6* addr6 = NULL;
-                
-                debugf("atyp=%d\n", atyp);
-
+    
+                slogf(SLOG_DEBUG, "atyp=%d\n", atyp);
+    
                 if (atyp == 1 || atyp == 4) { // IPv4 / IPv6 addresses
                     uint8_t packet[22];
                     uint8_t* ptr;
@@ -457,27 +1436,27 @@ static int handle_received_data(socks_server_connection_t * conn, int from_clien
                         return 1; // more data required
                     }
                     ptr = packet + 4;
-                    
+    
                     if (atyp == 1) {
                         conn->connect_addr.ss_family = AF_INET;
                         conn->connect_addr_len = sizeof(struct sockaddr_in);
-                        
+    
                         addr4 = (struct sockaddr_in*)&conn->connect_addr;
-
+    
                         memcpy(&addr4->sin_addr, ptr, 4); ptr+=4;
                         memcpy(&addr4->sin_port, ptr, 2);
                     } else {
                         conn->connect_addr.ss_family = AF_INET6;
                         conn->connect_addr_len = sizeof(struct sockaddr_in6);
-
+    
                         addr6 = (struct sockaddr_in6*)&conn->connect_addr;
-
+    
                         memcpy(&addr6->sin6_addr, ptr, 16); ptr+=16;
                         memcpy(&addr6->sin6_port, ptr, 2);
                     }
-                    
-                    conn->stage = CONNSTAGE_SOCK5CONNECT;
-                    
+    
+                    conn_set_stage(conn, CONNSTAGE_SOCK5CONNECT);
+    
                 } else if (atyp == 3) { // Domain name
                     uint8_t packet[7+256];
                     uint8_t* ptr;
@@ -485,80 +1464,173 @@ static int handle_received_data(socks_server_connection_t * conn, int from_clien
                         return 1; // more data required
                     }
                     ptr = packet + 4;
-
+    
                     size_t len = (uint8_t)*ptr;
                     ptr++;
-
+    
                     char hostname[256];
                     memcpy(hostname, ptr, len);
                     hostname[len] = 0;
                     ptr+=len;
-                    
+    
                     uint16_t port;
                     memcpy(&port, ptr, 2); ptr+=2;
-                    
+    
                     strcpy((char*)conn->resolve_hostname, hostname);
                     conn->resolve_port = ntohs(port);
-
-                    conn->stage = CONNSTAGE_SOCK5RESOLUTION;
+    
+                    conn_set_stage(conn, CONNSTAGE_SOCK5RESOLUTION);
                 } else {
-                    debugf("Bad address type: %d\n", *b);
-                    send_nosignal(conn->s, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+                    slogf_ratelimited(SLOG_INFO, "Bad address type: %d\n", *b);
+                    send_reply(conn, SOCKS5REP_ATYPUNSUPPORTED);
                     return 0;
                 }
             }
-            
+    
             if (conn->stage == CONNSTAGE_SOCK5RESOLUTION) {
                 resolve_addr_start(conn);
             }
-
+    
             if (conn->stage == CONNSTAGE_SOCK5RESOLUTIONFAIL) {
-                debugf("Resolution failed\n");
-                send_nosignal(conn->s, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+                slogf_ratelimited(SLOG_INFO, "Resolution failed\n");
+                send_reply(conn, SOCKS5REP_HOSTUNREACH);
                 return 0;
             }
-
+    
             if (conn->stage == CONNSTAGE_SOCK5CONNECTFAIL) {
-                debugf("Connection failed\n");
-                send_nosignal(conn->s, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+                slogf_ratelimited(SLOG_INFO, "Connection failed\n");
+                send_reply(conn, SOCKS5REP_HOSTUNREACH);
                 return 0;
             }
-
+    
             if (conn->stage == CONNSTAGE_FAIL) {
+                send_reply(conn, SOCKS5REP_GENERALFAIL);
                 return 0;
             }
-
+    
             if (conn->stage == CONNSTAGE_ECHO) {
-                if (!forward_data(conn->s, conn->s)) {
+                if (!echo_data(conn)) {
                     return 0;
                 }
             }
-
+    
         }
     }
     
     return 1;
 }
 
-static int handle_write_ready(socks_server_connection_t * conn) {
-    debugf("Connected\n");
+/**
+ * Answers a finished password check and goes on with what the client sent
+ * meanwhile; returns 0 when the connection is done.
+ */
+static int auth_complete_ifready(socks_server_connection_t * conn) {
+    socksauth_user_t* user;
     
-    int fl;
-    WARNFAIL_IFM1(fl = fcntl(conn->ts, F_GETFL, 0));
-    WARNFAIL_IFM1(fcntl(conn->ts, F_SETFL, fl & ~O_NONBLOCK));
-
-    if (send_nosignal(conn->s, "\x05\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10) != 10) {
-        debugf("write failed\n");
+    if (!socksauth_check_done(conn->server->auth, conn->auth_check, &user)) {
+        return 1;
+    }
+    
+    conn->auth_check = NULL;
+    
+    int http = conn->protocol == PROXYPROTO_CONNECT;
+    
+    if (user == NULL) {
+        slogf_ratelimited(SLOG_INFO, "Authentication failed\n");
+        if (http) {
+            client_send(conn, HTTP_407, strlen(HTTP_407));
+        } else {
+            client_send(conn, "\x01\x01", 2);
+        }
         return 0;
     }
-    if (!flush_buffer(conn->ts, &conn->s_buf)) {
-        debugf("buffer flushing failed\n");
+    
+    if (!http && !client_send(conn, "\x01\x00", 2)) {
         return 0;
     }
+    
+    conn_authenticated(conn, user);
+    conn_set_stage(conn, http ? CONNSTAGE_SOCK5RESOLUTION : CONNSTAGE_SOCK5SRECVCMD);
+    
+    return handle_received_data(conn, 1, 0);
+}
 
-    conn->stage = CONNSTAGE_CONNECTED;
+static int handle_tls_handshake(socks_server_connection_t * conn) {
+    int r = sockstls_handshake(conn->tls);
+    
+    conn->s_last = time(NULL);
+    
+    if (r == SOCKSTLS_FAIL) {
+        return 0;
+    }
+    
+    conn->tls_want_write = r == SOCKSTLS_WANT_WRITE;
+    
+    if (r != SOCKSTLS_DONE) {
+        return 1;
+    }
+    
+    conn->ktls_send = sockstls_ktls_send(conn->tls);
+    
+    slogf(SLOG_DEBUG, "TLS established, kTLS send: %d\n", conn->ktls_send);
+    
+    conn_set_stage(conn, CONNSTAGE_INIT);
+    
+    if (client_pending(conn)) { // request arrived with the last handshake flight
+        return handle_received_data(conn, 1, 0);
+    }
+    
+    return 1;
+}
+
+static int handle_write_ready(socks_server_connection_t * conn) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    SLOGFAIL_IFM1(SLOG_WARN, getsockopt(conn->ts, SOL_SOCKET, SO_ERROR, &err, &err_len));
+    
+    sockstrace(connect_done, CONNECT_DONE, conn->id, conn->stage, err);
+    
+    if (err != 0) {
+        slogf_ratelimited(SLOG_INFO, "Connection failed: %s\n", strerror(err));
+        breaker_report(conn, SOCKSBREAKER_FAILED);
+        send_reply(conn, err == ECONNREFUSED ? SOCKS5REP_REFUSED : SOCKS5REP_HOSTUNREACH);
+        return 0;
+    }
+    
+    slogf(SLOG_DEBUG, "Connected\n");
+    
+    breaker_report(conn, SOCKSBREAKER_OK);
+    
+    if (!send_reply(conn, SOCKS5REP_SUCCEEDED)) {
+        slogf(SLOG_DEBUG, "write failed\n");
+        return 0;
+    }
+    size_t early_data = conn->s_buf.size;
+    
+    if (early_data > 0) {
+        if (!relay_send(conn, 0, conn->s_buf.data, early_data, &conn->deficit_up)) {
+            slogf(SLOG_DEBUG, "buffer flushing failed\n");
+            return 0;
+        }
+    
+        buf_free(&conn->s_buf);
+        buf_initialize(&conn->s_buf);
+        conn_account(conn, early_data, 0);
+    }
+    
+    conn_set_stage(conn, CONNSTAGE_CONNECTED);
     conn->ts_last = time(NULL);
     
+    if (conn->server->sockmap != NULL && conn->tls == NULL && buf_length(&conn->up_buf) == 0 && buf_length(&conn->down_buf) == 0) {
+        // from here on the kernel relays, the loop only sees leftovers and EOF
+        conn->offloaded = socksbpf_link(conn->server->sockmap, conn->s, conn->ts);
+        conn->server->sockmap_links += conn->offloaded;
+        conn->offload_counted = conn->offloaded && socksbpf_bytes_read(conn->s, &conn->offload_read_s)
+                && socksbpf_bytes_read(conn->ts, &conn->offload_read_ts);
+        conn->offload_up = conn->bytes_up;
+        conn->offload_down = conn->bytes_down;
+    }
+    
     return 1;
     
     CATCH;
@@ -566,204 +1638,868 @@ static int handle_write_ready(socks_server_connection_t * conn) {
     return 0;
 }
 
+/**
+ * Reports what the kernel relayed for an offloaded tunnel since the last
+ * settlement: bytes read off a leg that the loop did not account itself.
+ */
+static void offload_account(socks_server_connection_t * conn) {
+    uint64_t read_s, read_ts;
+    
+    if (!conn->offload_counted || !socksbpf_bytes_read(conn->s, &read_s) || !socksbpf_bytes_read(conn->ts, &read_ts)) {
+        return;
+    }
+    
+    uint64_t up = read_s - conn->offload_read_s, down = read_ts - conn->offload_read_ts;
+    uint64_t seen_up = conn->bytes_up - conn->offload_up, seen_down = conn->bytes_down - conn->offload_down;
+    
+    up = up > seen_up ? up - seen_up : 0;
+    down = down > seen_down ? down - seen_down : 0;
+    
+    if (up > 0 || down > 0) {
+        conn_account(conn, up, down);
+    }
+    
+    conn->offload_read_s = read_s;
+    conn->offload_read_ts = read_ts;
+    conn->offload_up = conn->bytes_up;
+    conn->offload_down = conn->bytes_down;
+}
+
+/**
+ * Offloaded tunnels carry data the loop never sees, take the idle time
+ * from the kernel before timing them out.
+ */
+static void offload_refresh_activity(socks_server_connection_t * conn) {
+    struct tcp_info ti;
+    socklen_t ti_len = sizeof(ti);
+    time_t now = time(NULL);
+    
+    offload_account(conn);
+    
+    if (getsockopt(conn->s, IPPROTO_TCP, TCP_INFO, &ti, &ti_len) == 0) {
+        conn->s_last = now - ti.tcpi_last_data_recv / 1000;
+    }
+    
+    ti_len = sizeof(ti);
+    if (getsockopt(conn->ts, IPPROTO_TCP, TCP_INFO, &ti, &ti_len) == 0) {
+        conn->ts_last = now - ti.tcpi_last_data_recv / 1000;
+    }
+}
+
 #define handle_except(x) (0)
 //static int handle_except(socks_server_connection_t * conn) {
 //    return 0;
 //}
 
+/**
+ * Events the connection waits for in its current stage, as epoll events
+ * for the client (s) and tunnel (ts) sockets.
+ */
+static void conn_interest(socks_server_connection_t * cc, uint32_t* ev_s, uint32_t* ev_ts) {
+    *ev_s = 0;
+    *ev_ts = 0;
+    
+    if (cc->stage == CONNSTAGE_SOCK5RESOLUTION_INPROGRESS || cc->stage == CONNSTAGE_AUTH_INPROGRESS
+            || cc->stage == CONNSTAGE_SOCKMAPDRAIN) {
+        // skip
+    } else if (cc->stage == CONNSTAGE_TLSHANDSHAKE) {
+        *ev_s = cc->tls_want_write ? EPOLLOUT : EPOLLIN;
+    } else if (cc->stage == CONNSTAGE_SOCK5CONNECTING && cc->ts != -1) {
+        *ev_ts = EPOLLOUT;
+    } else {
+        // a leg with a backlog waits to be writable, the other one (an echo
+        // client itself) is not read meanwhile
+        int s_held = buf_length(&cc->up_buf) > 0 || (cc->ts == -1 && buf_length(&cc->down_buf) > 0);
+    
+        *ev_s = (s_held ? 0 : EPOLLIN) | (buf_length(&cc->down_buf) > 0 ? EPOLLOUT : 0);
+        if (cc->ts != -1) {
+            *ev_ts = (buf_length(&cc->down_buf) == 0 ? EPOLLIN : 0) | (buf_length(&cc->up_buf) > 0 ? EPOLLOUT : 0);
+        }
+    }
+}
+
 void socks_server_periodic_select_prepare(socks_server_t * s, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, int* maxfd) {
     FD_SET(s->s, readfds);
     MAX_UPDATE(*maxfd, s->s);
-
+    
+    resolve_reap(s, 0);
+    
     socks_server_connection_t* cc = s->cc;
-
+    
     while (cc != NULL) {
+        uint32_t ev_s, ev_ts;
+    
         if (cc->stage == CONNSTAGE_SOCK5RESOLUTION_INPROGRESS) {
             resolve_addr_complete_ifready(cc);
         }
-        
-        if (cc->stage == CONNSTAGE_SOCK5RESOLUTION_INPROGRESS) {
-            // skip
-        } else if (cc->stage == CONNSTAGE_SOCK5CONNECTING && cc->ts != -1) {
+    
+        conn_interest(cc, &ev_s, &ev_ts);
+    
+        if (ev_s & EPOLLIN) {
+            FD_SET(cc->s, readfds);
+        }
+        if (ev_s & EPOLLOUT) {
+            FD_SET(cc->s, writefds);
+        }
+        if (ev_s != 0) {
+            MAX_UPDATE(*maxfd, cc->s);
+        }
+        if (ev_ts & EPOLLOUT) {
             FD_SET(cc->ts, writefds);
             FD_SET(cc->ts, exceptfds);
+        }
+        if (ev_ts & EPOLLIN) {
+            FD_SET(cc->ts, readfds);
+        }
+        if (ev_ts != 0) {
             MAX_UPDATE(*maxfd, cc->ts);
-        } else {
-            FD_SET(cc->s, readfds);
-            MAX_UPDATE(*maxfd, cc->s);
-            if (cc->ts != -1) {
-                FD_SET(cc->ts, readfds);
-                MAX_UPDATE(*maxfd, cc->ts);
-            }
         }
-
+    
         cc = cc->next;
     }
 }
 
 static void client_conn_cleanup(socks_server_connection_t * conn) {
+    socks_server_t* s = conn->server;
+    
+    sockstrace(close, CLOSE, conn->id, conn->stage, conn->max_wait);
+    
+    if (conn->offloaded) {
+        offload_account(conn);
+    }
+    
+    if (s->callbacks.close != NULL) {
+        s->callbacks.close(s->callbacks.closure, conn->id, conn->bytes_up, conn->bytes_down);
+    }
+    
+    // client gone or timed out while resolving / connecting
+    breaker_report(conn, SOCKSBREAKER_ABANDONED);
+    
+    if (conn->user != NULL) {
+        __atomic_add_fetch(&conn->user->bytes_up, conn->bytes_up, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&conn->user->bytes_down, conn->bytes_down, __ATOMIC_RELAXED);
+    }
+    
+    if (conn->auth_check != NULL) {
+        socksauth_check_abandon(s->auth, conn->auth_check);
+    }
+    
+    sockstls_conn_free(conn->tls);
+    
     if (conn->s != -1) {
-        WARN_IFM1(close(conn->s));
+        SLOG_IFM1(SLOG_WARN, close(conn->s));
     }
     
     if (conn->ts != -1) {
-        WARN_IFM1(close(conn->ts));
+        SLOG_IFM1(SLOG_WARN, close(conn->ts));
     }
     
     buf_free(&conn->s_buf);
+    buf_free(&conn->up_buf);
+    buf_free(&conn->down_buf);
     
-    resolve_addr_cancel(conn);
+    if (resolve_addr_cancel(conn)) {
+        if (conn->resolve_gaicb.ar_result != NULL) {
+            freeaddrinfo(conn->resolve_gaicb.ar_result);
+            conn->resolve_gaicb.ar_result = NULL;
+        }
+    
+        free(conn);
+    } else {
+        conn->next = s->cc_resolving;
+        s->cc_resolving = conn;
+    }
+    
+    __atomic_sub_fetch(&clients_connected, 1, __ATOMIC_RELAXED);
+    dumpcc();
+}
 
-    if (conn->resolve_gaicb.ar_result != NULL) {
-        freeaddrinfo(conn->resolve_gaicb.ar_result);
-        conn->resolve_gaicb.ar_result = NULL;
+static void conn_unlink(socks_server_t * s, socks_server_connection_t * conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        s->cc = conn->next;
+    }
+    
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    } else {
+        s->cc_tail = conn->prev;
     }
     
-    free(conn);
+    if (s->rr_next == conn) {
+        s->rr_next = conn->next;
+    }
     
-    clients_connected--;
-    dumpcc();
+    s->n_cc--;
 }
 
-int socks_server_periodic_process(socks_server_t * s, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, int* num) {
-    if (*num > 0) {
-        if (FD_ISSET(s->s, readfds)) {
-            int sock;
-            struct sockaddr_storage * sin;
-            socklen_t sin_len = sizeof(struct sockaddr_storage);
-            WARNFAIL_IFM1(sock = accept(s->s, (struct sockaddr *)&sin, &sin_len));
-            handle_new_socket(s, sock, (struct sockaddr *)&sin, sin_len);
-            (*num)--;
+static socks_server_connection_t* accept_new(socks_server_t * s) {
+    struct sockaddr_storage sin;
+    socklen_t sin_len = sizeof(sin);
+    int sock;
+    
+    if ((sock = accept(s->s, (struct sockaddr *)&sin, &sin_len)) == -1) {
+        if (errno != EAGAIN) {
+            slogf_ratelimited(SLOG_WARN, "accept: %s\n", strerror(errno));
         }
+        return NULL;
     }
+    
+    return handle_new_socket(s, sock, (struct sockaddr *)&sin, sin_len);
+}
 
-    socks_server_connection_t* cc = s->cc;
-    socks_server_connection_t* cc_prev = NULL;
+/**
+ * Runs the connection's state machine for the socket events (CONNEV_*),
+ * returns 0 when the connection is done.
+ */
+static int conn_dispatch_events(socks_server_connection_t * cc, int events) {
+    if (cc->stage == CONNSTAGE_TLSHANDSHAKE) {
+        if ((events & (CONNEV_S_READ | CONNEV_S_WRITE)) && !handle_tls_handshake(cc)) {
+            slogf(SLOG_DEBUG, "TLS handshake failed\n");
+            return 0;
+        }
+    
+        return 1;
+    }
+    
+    if (cc->stage == CONNSTAGE_SOCK5CONNECTING && cc->ts != -1) {
+        if (events & CONNEV_TS_EXCEPT) {
+            if (!handle_except(cc)) {
+                return 0;
+            }
+        } else if (events & CONNEV_TS_WRITE) {
+            if (!handle_write_ready(cc)) {
+                return 0;
+            }
+        }
+    } else if (events & CONNEV_TS_WRITE) {
+        if (!relay_flush(cc, 0, &cc->deficit_up)) {
+            return 0;
+        }
+        cc->ts_last = time(NULL);
+    }
+    
+    if (events & CONNEV_S_WRITE) {
+        if (!relay_flush(cc, 1, &cc->deficit_down)) {
+            return 0;
+        }
+        cc->s_last = time(NULL);
+    }
+    
+    int data_from_client = (events & CONNEV_S_READ) != 0;
+    int data_from_tunnel = cc->ts != -1 && (events & CONNEV_TS_READ);
+    
+    // decrypted TLS data held back by a backlog is invisible to the poller
+    if ((events & CONNEV_TS_WRITE) && buf_length(&cc->up_buf) == 0 && client_pending(cc)) {
+        data_from_client = 1;
+    }
+    
+    if ((data_from_client || data_from_tunnel) && !handle_received_data(cc, data_from_client, data_from_tunnel)) {
+        slogf(SLOG_DEBUG, "Connection data handle fail, stage: %d\n", cc->stage);
+    
+        if (!cc->offloaded) {
+            return 0;
+        }
+    
+        cc->drain_until = monotonic_usec() + SOCKMAP_DRAIN_USEC;
+        conn_set_stage(cc, CONNSTAGE_SOCKMAPDRAIN);
+        server_deadline_update(cc->server, cc->drain_until);
+    }
+    
+    return 1;
+}
 
-    while (cc != NULL) {
-        int delete = 0;
+/**
+ * Scheduling wrapper for conn_dispatch_events(), records how long the
+ * connection waited for its turn: since the wakeup that reported it, or
+ * since its previous turn when it was preempted.
+ */
+static int conn_handle_events(socks_server_connection_t * cc, int events, uint64_t wake) {
+    if (events == 0) {
+        return 1;
+    }
+    
+    uint64_t start = monotonic_usec();
+    uint64_t since = cc->wait_since != 0 ? cc->wait_since : wake;
+    uint64_t wait = start > since ? start - since : 0;
+    
+    if (wait > cc->max_wait) {
+        cc->max_wait = wait;
+        MAX_UPDATE(cc->server->sched_max_wait_usec, wait);
+    }
+    
+    cc->backlogged = 0;
+    
+    if (!conn_dispatch_events(cc, events)) {
+        return 0;
+    }
+    
+    cc->wait_since = cc->backlogged ? monotonic_usec() : 0;
+    
+    return 1;
+}
 
-        if (*num > 0) {
-            int tunnel_event = 0;
-            if (cc->stage == CONNSTAGE_SOCK5CONNECTING && cc->ts != -1) {
-                if (FD_ISSET(cc->ts, exceptfds)) {
-                    tunnel_event = 1;
-                    if (!handle_except(cc)) {
-                        delete = 1;
-                    }
-                } else if (FD_ISSET(cc->ts, writefds)) {
-                    tunnel_event = 1;
-                    if (!handle_write_ready(cc)) {
-                        delete = 1;
-                    }
-                }
-            }
+/**
+ * Acts on stages reached outside of socket events (request parsed,
+ * password checked, resolution finished), returns 0 when the connection
+ * is done.
+ */
+static int conn_advance(socks_server_connection_t * cc) {
+    socks_server_t* s = cc->server;
+    
+    if (cc->stage == CONNSTAGE_AUTH_INPROGRESS && !auth_complete_ifready(cc)) {
+        return 0;
+    }
+    
+    if (cc->stage == CONNSTAGE_SOCK5CONNECT) {
+        const char* hostname = cc->resolve_hostname[0] != 0 ? (const char*)cc->resolve_hostname : NULL;
+    
+        if (s->callbacks.connect != NULL && !s->callbacks.connect(s->callbacks.closure, cc->id, hostname,
+                (struct sockaddr *)&cc->connect_addr, &cc->connect_addr_len)) {
+            slogf_ratelimited(SLOG_INFO, "Connection not allowed\n");
+            send_reply(cc, SOCKS5REP_NOTALLOWED);
+            return 0;
+        }
+    
+        connect_addr(cc);
+    }
+    
+    if (cc->stage == CONNSTAGE_SOCK5RESOLUTIONFAIL || cc->stage == CONNSTAGE_SOCK5CONNECTFAIL) {
+        slogf_ratelimited(SLOG_INFO, "Connection failed, stage: %d\n", cc->stage);
+        send_reply(cc, SOCKS5REP_HOSTUNREACH);
+        return 0;
+    }
+    
+    return cc->stage != CONNSTAGE_FAIL;
+}
 
-            int data_from_client = FD_ISSET(cc->s, readfds);
-            int data_from_tunnel = cc->ts != -1 ? FD_ISSET(cc->ts, readfds) : 0;
+static void server_pool_maintain(socks_server_t * s) {
+    if (s->pool == NULL) {
+        return;
+    }
+    
+    sockspool_maintain(s->pool);
+    server_deadline_update(s, sockspool_next_deadline(s->pool));
+}
 
-            if ((data_from_client || data_from_tunnel) && !delete) {
-                if (!handle_received_data(cc, data_from_client, data_from_tunnel)) {
-                    debugf("Connection data handle fail, stage: %d\n", cc->stage);
-                    delete = 1;
+/**
+ * Drain period and read timeouts, returns 0 when the connection is done.
+ */
+static int conn_check_deadlines(socks_server_connection_t * cc) {
+    if (cc->stage == CONNSTAGE_SOCKMAPDRAIN) {
+        return monotonic_usec() < cc->drain_until;
+    }
+    
+    time_t th = time(NULL) - cc->server->socket_read_timeout;
+    
+    if (cc->offloaded && (cc->s_last < th || cc->ts_last < th)) {
+        offload_refresh_activity(cc);
+    }
+    
+    if (cc->s_last < th || (cc->ts != -1 && cc->ts_last < th)) {
+        slogf(SLOG_DEBUG, "Connection timed out\n");
+        return 0;
+    }
+    
+    return 1;
+}
+
+int socks_server_periodic_process(socks_server_t * s, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, int* num) {
+    if (*num > 0 && FD_ISSET(s->s, readfds)) {
+        accept_new(s);
+        (*num)--;
+    }
+    
+    uint64_t wake = monotonic_usec();
+    
+    // round-robin: each round starts one connection further than the last
+    socks_server_connection_t* cc = s->rr_next != NULL ? s->rr_next : s->cc;
+    int n = s->n_cc;
+    
+    s->rr_next = cc != NULL ? cc->next : NULL;
+    
+    for (; n > 0; n--) {
+        socks_server_connection_t* next = cc->next != NULL ? cc->next : s->cc;
+        int events = 0;
+    
+        if (*num > 0) {
+            if (FD_ISSET(cc->s, readfds)) {
+                events |= CONNEV_S_READ;
+            }
+            if (FD_ISSET(cc->s, writefds)) {
+                events |= CONNEV_S_WRITE;
+            }
+            if (cc->ts != -1) {
+                if (FD_ISSET(cc->ts, readfds)) {
+                    events |= CONNEV_TS_READ;
+                }
+                if (FD_ISSET(cc->ts, writefds)) {
+                    events |= CONNEV_TS_WRITE;
+                }
+                if (FD_ISSET(cc->ts, exceptfds)) {
+                    events |= CONNEV_TS_EXCEPT;
                 }
             }
-
-            if (data_from_client) {
+    
+            if (events & (CONNEV_S_READ | CONNEV_S_WRITE)) {
                 (*num)--;
             }
-            if (data_from_tunnel || tunnel_event) {
+            if (events & (CONNEV_TS_READ | CONNEV_TS_WRITE | CONNEV_TS_EXCEPT)) {
                 (*num)--;
             }
         }
-        
-        if (cc->stage == CONNSTAGE_SOCK5CONNECT) {
-            connect_addr(cc);
+    
+        if (!conn_handle_events(cc, events, wake) || !conn_advance(cc) || !conn_check_deadlines(cc)) {
+            conn_unlink(s, cc);
+            client_conn_cleanup(cc);
         }
+    
+        cc = next;
+    }
+    
+    server_pool_maintain(s);
+    
+    return 1;
+}
 
-        if (!delete) {
-            time_t th = time(NULL) - s->socket_read_timeout;
-            
-            if (cc->s_last < th) {
-                debugf("Connection timed out\n");
-                delete = 1;
-            }
+/*
+ * Embedding mode
+ */
+
+static int epoll_update(socks_server_t * s, int fd, uint32_t* registered, uint32_t events, uint64_t tag) {
+    struct epoll_event ev;
+    
+    if (*registered == events) {
+        return 1;
+    }
+    
+    ev.events = events;
+    ev.data.u64 = tag;
+    
+    WARNFAIL_IFM1(epoll_ctl(s->epfd, *registered == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &ev));
+    *registered = events;
+    
+    return 1;
+    
+    CATCH;
+    
+    return 0;
+}
+
+static int conn_update_interest(socks_server_connection_t * cc) {
+    socks_server_t* s = cc->server;
+    uint32_t ev_s, ev_ts;
+    
+    conn_interest(cc, &ev_s, &ev_ts);
+    
+    if (cc->ts == -1) {
+        cc->ep_ts = 0; // a closed socket leaves the epoll set by itself
+    }
+    
+    return epoll_update(s, cc->s, &cc->ep_s, ev_s, (uintptr_t)cc)
+            && (cc->ts == -1 || epoll_update(s, cc->ts, &cc->ep_ts, ev_ts, (uintptr_t)cc | EPTAG_TUNNEL));
+}
+
+/**
+ * Ready connections are served in the order epoll reported them.
+ */
+static void conn_enqueue(socks_server_connection_t *** ready_tail, socks_server_connection_t * cc, int events) {
+    cc->ready_events |= events;
+    
+    if (!cc->ready_queued) {
+        cc->ready_queued = 1;
+        cc->ready_next = NULL;
+        **ready_tail = cc;
+        *ready_tail = &cc->ready_next;
+    }
+}
 
-            if (cc->ts != -1 && cc->ts_last < th) {
-                debugf("Connection timed out\n");
-                delete = 1;
+/**
+ * Translates an epoll event to CONNEV_* bits, limited to what is
+ * registered for the socket.
+ */
+static int conn_events(uint32_t ev, uint32_t registered, int read_bit, int write_bit) {
+    int events = 0;
+    
+    if ((ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) && (registered & EPOLLIN)) {
+        events |= read_bit;
+    }
+    if ((ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && (registered & EPOLLOUT)) {
+        events |= write_bit;
+    }
+    
+    return events;
+}
+
+/**
+ * Applies the connection deadlines and computes the next one.
+ */
+static void server_sweep(socks_server_t * s) {
+    socks_server_connection_t* cc = s->cc;
+    uint64_t next_deadline = UINT64_MAX;
+    
+    while (cc != NULL) {
+        socks_server_connection_t* next = cc->next;
+    
+        if (!conn_check_deadlines(cc)) {
+            conn_unlink(s, cc);
+            client_conn_cleanup(cc);
+        } else {
+            uint64_t deadline = cc->stage == CONNSTAGE_SOCKMAPDRAIN ? cc->drain_until : conn_timeout_deadline(cc);
+    
+            if (deadline < next_deadline) {
+                next_deadline = deadline;
             }
         }
+    
+        cc = next;
+    }
+    
+    s->next_deadline = next_deadline;
+    
+    resolve_reap(s, 0);
+}
 
-        if (delete) {
-            if (cc_prev) {
-                cc = cc->next;
+int socks_server_epoll_fd(socks_server_t * s) {
+    struct epoll_event ev;
+    int fl;
+    
+    if (s->epfd != -1) {
+        return s->epfd;
+    }
+    
+    if (s->cc != NULL) {
+        slogf(SLOG_ERROR, "socks_server_epoll_fd() must be called before the server is processed\n");
+        return -1;
+    }
+    
+    WARNFAIL_IFM1(s->epfd = epoll_create1(EPOLL_CLOEXEC));
+    WARNFAIL_IFM1(s->resolve_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    
+    if ((s->resolve_notifier = malloc(sizeof(struct resolve_notifier))) == NULL) {
+        goto fail;
+    }
+    s->resolve_notifier->efd = s->resolve_efd;
+    s->resolve_notifier->refs = 1;
+    
+    // a level-triggered listener can be reported again after a peer gave up
+    WARNFAIL_IFM1(fl = fcntl(s->s, F_GETFL, 0));
+    WARNFAIL_IFM1(fcntl(s->s, F_SETFL, fl | O_NONBLOCK));
+    
+    ev.events = EPOLLIN;
+    ev.data.u64 = EPTAG_LISTENER;
+    WARNFAIL_IFM1(epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->s, &ev));
+    
+    ev.events = EPOLLIN;
+    ev.data.u64 = EPTAG_RESOLVER;
+    WARNFAIL_IFM1(epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->resolve_efd, &ev));
+    
+    return s->epfd;
+    
+    CATCH;
+    
+    if (s->resolve_notifier != NULL) {
+        resolve_notifier_release(s->resolve_notifier);
+        s->resolve_notifier = NULL;
+    } else if (s->resolve_efd != -1) {
+        WARN_IFM1(close(s->resolve_efd));
+    }
+    s->resolve_efd = -1;
+    if (s->epfd != -1) {
+        WARN_IFM1(close(s->epfd));
+        s->epfd = -1;
+    }
+    
+    return -1;
+}
 
-                client_conn_cleanup(cc_prev->next);
-                cc_prev->next = cc;
-            } else {
-                socks_server_connection_t* cc_del = cc;
-                s->cc = cc->next;
+int socks_server_next_timeout(socks_server_t * s) {
+    if (s->next_deadline == UINT64_MAX) {
+        return -1;
+    }
+    
+    uint64_t now = monotonic_usec();
+    
+    if (now >= s->next_deadline) {
+        return 0;
+    }
+    
+    uint64_t ms = (s->next_deadline - now + 999) / 1000;
+    
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
 
-                client_conn_cleanup(cc_del);
-                
-                cc = s->cc;
+int socks_server_process_events(socks_server_t * s) {
+    struct epoll_event events[EPOLL_BATCH];
+    socks_server_connection_t* ready = NULL;
+    socks_server_connection_t** ready_tail = &ready;
+    socks_server_connection_t* cc;
+    uint64_t wake;
+    int n, i;
+    
+    if (s->epfd == -1) {
+        return 0;
+    }
+    
+    if ((n = epoll_wait(s->epfd, events, EPOLL_BATCH, 0)) == -1) {
+        if (errno != EINTR) {
+            slogf(SLOG_WARN, "epoll_wait: %s\n", strerror(errno));
+            return 0;
+        }
+        n = 0;
+    }
+    
+    wake = monotonic_usec();
+    
+    // collect the batch first, connections are deleted only once it is read
+    for (i = 0; i < n; i++) {
+        uint64_t tag = events[i].data.u64;
+    
+        if (tag == EPTAG_LISTENER) {
+            if ((cc = accept_new(s)) != NULL) {
+                conn_enqueue(&ready_tail, cc, 0);
+            }
+        } else if (tag == EPTAG_RESOLVER) {
+            uint64_t completions;
+    
+            if (read(s->resolve_efd, &completions, sizeof(completions)) == -1 && errno != EAGAIN) {
+                slogf(SLOG_WARN, "eventfd read: %s\n", strerror(errno));
+            }
+    
+            resolve_reap(s, 0);
+    
+            for (cc = s->cc; cc != NULL; cc = cc->next) {
+                if (cc->stage == CONNSTAGE_SOCK5RESOLUTION_INPROGRESS) {
+                    resolve_addr_complete_ifready(cc);
+    
+                    if (cc->stage != CONNSTAGE_SOCK5RESOLUTION_INPROGRESS) {
+                        conn_enqueue(&ready_tail, cc, 0);
+                    }
+                } else if (cc->stage == CONNSTAGE_AUTH_INPROGRESS) {
+                    conn_enqueue(&ready_tail, cc, 0); // conn_advance() looks
+                }
             }
         } else {
-            cc_prev = cc;
-            cc = cc->next;
+            cc = (socks_server_connection_t*)(uintptr_t)(tag & ~(uint64_t)EPTAG_TUNNEL);
+    
+            if (tag & EPTAG_TUNNEL) {
+                conn_enqueue(&ready_tail, cc, conn_events(events[i].events, cc->ep_ts, CONNEV_TS_READ, CONNEV_TS_WRITE));
+            } else {
+                conn_enqueue(&ready_tail, cc, conn_events(events[i].events, cc->ep_s, CONNEV_S_READ, CONNEV_S_WRITE));
+            }
         }
     }
     
-    return 1;
+    while (ready != NULL) {
+        cc = ready;
+        ready = cc->ready_next;
     
-    CATCH;
+        int ev = cc->ready_events;
     
-    return 0;
+        cc->ready_events = 0;
+        cc->ready_queued = 0;
+    
+        if (!conn_handle_events(cc, ev, wake) || !conn_advance(cc) || !conn_update_interest(cc)) {
+            conn_unlink(s, cc);
+            client_conn_cleanup(cc);
+        }
+    }
+    
+    if (monotonic_usec() >= s->next_deadline) {
+        server_sweep(s);
+    }
+    
+    server_pool_maintain(s);
+    
+    return 1;
 }
 
 int socks_server_periodic(socks_server_t * s, int wait_millis) {
-    struct timeval tv;
-    tv.tv_sec = wait_millis / 1000;
-    tv.tv_usec = (wait_millis - (tv.tv_sec * 1000)) * 1000;
+    return socks_server_periodic_multi(&s, 1, wait_millis);
+}
 
-    fd_set readfds;
-    fd_set writefds;
-    fd_set exceptfds;
+int socks_server_periodic_multi(socks_server_t ** servers, int n_servers, int wait_millis) {
+    struct timeval tv;
+    
+    fd_set readfds, readfds_w;
+    fd_set writefds, writefds_w;
+    fd_set exceptfds, exceptfds_w;
     int maxfd = -1;
+    int spin_usec = 0;
+    int result = 1;
+    int i;
     
     FD_ZERO(&readfds);
     FD_ZERO(&writefds);
     FD_ZERO(&exceptfds);
-
-    socks_server_periodic_select_prepare(s, &readfds, &writefds, &exceptfds, &maxfd);
     
-    int num;
-
+    for (i = 0; i < n_servers; i++) {
+        socks_server_periodic_select_prepare(servers[i], &readfds, &writefds, &exceptfds, &maxfd);
+        MAX_UPDATE(spin_usec, servers[i]->spin_usec);
+    }
+    
+    int num = 0;
+    
     if (maxfd != -1) {
-        WARNFAIL_IFM1(num = select(maxfd + 1, &readfds, &writefds, &exceptfds, &tv));
+        if (spin_usec > 0) {
+            uint64_t spin_end = monotonic_usec() + spin_usec;
+    
+            do {
+                readfds_w = readfds;
+                writefds_w = writefds;
+                exceptfds_w = exceptfds;
+                tv.tv_sec = 0;
+                tv.tv_usec = 0;
+    
+                WARNFAIL_IFM1(num = select(maxfd + 1, &readfds_w, &writefds_w, &exceptfds_w, &tv));
+            } while (num == 0 && monotonic_usec() < spin_end);
+    
+            if (num > 0) {
+                for (i = 0; i < n_servers; i++) {
+                    servers[i]->spin_wakeups++;
+                }
+            }
+        }
+    
+        if (num == 0) {
+            readfds_w = readfds;
+            writefds_w = writefds;
+            exceptfds_w = exceptfds;
+            tv.tv_sec = wait_millis / 1000;
+            tv.tv_usec = (wait_millis - (tv.tv_sec * 1000)) * 1000;
+    
+            WARNFAIL_IFM1(num = select(maxfd + 1, &readfds_w, &writefds_w, &exceptfds_w, &tv));
+    
+            for (i = 0; i < n_servers; i++) {
+                servers[i]->sleep_wakeups++;
+            }
+        }
     } else {
+        FD_ZERO(&readfds_w);
+        FD_ZERO(&writefds_w);
+        FD_ZERO(&exceptfds_w);
         WARN_IFM1(usleep(wait_millis * 1000));
     }
     
-    return socks_server_periodic_process(s, &readfds, &writefds, &exceptfds, &num);
-
+    for (i = 0; i < n_servers; i++) {
+        if (!socks_server_periodic_process(servers[i], &readfds_w, &writefds_w, &exceptfds_w, &num)) {
+            result = 0;
+        }
+    }
+    
+    return result;
+    
     CATCH;
+    
+    return 0;
+}
 
+int socks_server_enable_sockmap(socks_server_t * s) {
+    if (s->sockmap == NULL) {
+        s->sockmap = socksbpf_open(SOCKMAP_MAX_SOCKETS);
+    }
+    
+    return s->sockmap != NULL;
+}
+
+void socks_server_set_auth(socks_server_t * s, struct socksauth* auth) {
+    s->auth = auth;
+}
+
+int socks_server_set_tuning(socks_server_t * s, struct sockstune* tune, const char* profile) {
+    s->tune = tune;
+    s->tune_listener = NULL;
+    
+    if (profile != NULL) {
+        if ((s->tune_listener = sockstune_profile(tune, profile)) == NULL) {
+            slogf(SLOG_ERROR, "No tuning profile %s\n", profile);
+            return 0;
+        }
+    } else {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+    
+        WARNFAIL_IFM1(getsockname(s->s, (struct sockaddr *)&addr, &addr_len));
+    
+        s->tune_listener = sockstune_match_listener(tune, ntohs(((struct sockaddr_in *)&addr)->sin_port));
+    }
+    
+    // accepted sockets inherit the options, and SO_RCVBUF has to be set
+    // before the handshake for a larger window scale
+    if (s->tune_listener != NULL) {
+        sockstune_apply(s->tune_listener, s->s);
+    }
+    
+    return 1;
+    
+    CATCH;
+    
     return 0;
 }
 
+void socks_server_set_breaker(socks_server_t * s, struct socksbreaker* breaker) {
+    s->breaker = breaker;
+}
+
+void socks_server_set_pool(socks_server_t * s, struct sockspool* pool) {
+    s->pool = pool;
+}
+
+void socks_server_set_callbacks(socks_server_t * s, const socks_server_callbacks_t * callbacks) {
+    s->callbacks = *callbacks;
+}
+
+int socks_server_set_tls(socks_server_t * s, const char* cert_file, const char* key_file) {
+    sockstls_ctx_t* ctx = sockstls_ctx_new(cert_file, key_file);
+    
+    if (ctx == NULL) {
+        return 0;
+    }
+    
+    sockstls_ctx_free(s->tls);
+    s->tls = ctx;
+    
+    return 1;
+}
+
+int socks_server_enable_ktls(socks_server_t * s) {
+    return s->tls != NULL && sockstls_ctx_enable_ktls(s->tls);
+}
+
 void socks_server_cleanup(socks_server_t * s) {
     WARNFAIL_IFNZ(close(s->s));
     s->s = -1;
     
     while (s->cc != NULL) {
         socks_server_connection_t* c = s->cc;
-        
+    
         s->cc = c->next;
-
+    
         client_conn_cleanup(c);
     }
+    s->cc_tail = NULL;
+    s->rr_next = NULL;
+    s->n_cc = 0;
+    
+    resolve_reap(s, 1);
+    
+    sockstls_ctx_free(s->tls);
+    s->tls = NULL;
+    
+    socksbpf_close(s->sockmap);
+    s->sockmap = NULL;
+    
+    if (s->epfd != -1) {
+        WARN_IFM1(close(s->epfd));
+        s->epfd = -1;
+    }
+    // lookup notifications still on their way keep the eventfd open
+    if (s->resolve_notifier != NULL) {
+        resolve_notifier_release(s->resolve_notifier);
+        s->resolve_notifier = NULL;
+        s->resolve_efd = -1;
+    }
     
     return;
     CATCH;
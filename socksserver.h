@@ -18,9 +18,49 @@ extern "C" {
 
 typedef int socks_server_peerfilter(void *closure, struct sockaddr * addr, socklen_t addr_len);
 
+/**
+ * Event callbacks for embedding applications, all optional. They run on
+ * the thread processing the server.
+ */
+typedef struct {
+    void* closure;
+
+    /**
+     * a client connection was accepted (after the peer filter)
+     */
+    void (*open)(void* closure, uint32_t conn_id, const struct sockaddr * peer, socklen_t peer_len);
+
+    /**
+     * the connection is closed, with the bytes relayed in each direction
+     */
+    void (*close)(void* closure, uint32_t conn_id, uint64_t bytes_up, uint64_t bytes_down);
+
+    /**
+     * decides a CONNECT request before the target is dialed; hostname is
+     * NULL when the client sent an address. The destination may be
+     * rewritten in place. Returns 0 to refuse the request.
+     */
+    int (*connect)(void* closure, uint32_t conn_id, const char* hostname, struct sockaddr * dest, socklen_t * dest_len);
+
+    /**
+     * bytes relayed since the previous call, client to target (up) and
+     * target to client (down). Tunnels relayed by the sockmap are
+     * reported in batches from the kernel's counters, at least once per
+     * read timeout and on close.
+     */
+    void (*bytes)(void* closure, uint32_t conn_id, uint64_t up, uint64_t down);
+
+    /**
+     * the client proved to be user (see socks_server_set_auth())
+     */
+    void (*authenticated)(void* closure, uint32_t conn_id, const char* user);
+} socks_server_callbacks_t;
+
 struct socks_server_connection;
 typedef struct socks_server_connection socks_server_connection_t;
 
+struct resolve_notifier;
+
 typedef struct {
     /**
      * server socket connections
@@ -28,18 +68,199 @@ typedef struct {
     int s;
 
     /**
-     * client connections linked list
+     * client connections linked list, oldest first, and the connection
+     * the next round-robin round starts with
      */
     socks_server_connection_t* cc;
+    socks_server_connection_t* cc_tail;
+    socks_server_connection_t* rr_next;
+    int n_cc;
+
+    /**
+     * closed connections whose name lookup could not be cancelled, freed
+     * once getaddrinfo_a() is done writing to them
+     */
+    socks_server_connection_t* cc_resolving;
     
     time_t socket_read_timeout;
 
     socks_server_peerfilter* peer_filter;
     void* peer_filter_closure;
+
+    socks_server_callbacks_t callbacks;
+
+    /**
+     * embedding mode, see socks_server_epoll_fd()
+     */
+    int epfd;
+    int resolve_efd;
+    struct resolve_notifier* resolve_notifier;
+    uint64_t next_deadline;
+
+    /**
+     * TLS listener context, see socks_server_set_tls()
+     */
+    struct sockstls_ctx* tls;
+
+    /**
+     * in-kernel relaying of established tunnels, see
+     * socks_server_enable_sockmap()
+     */
+    struct socksbpf* sockmap;
+    uint64_t sockmap_links;
+
+    /**
+     * pre-connected outbound sockets, see socks_server_set_pool()
+     */
+    struct sockspool* pool;
+
+    /**
+     * credential store, see socks_server_set_auth()
+     */
+    struct socksauth* auth;
+
+    /**
+     * socket tuning rules and the listener's profile, see
+     * socks_server_set_tuning()
+     */
+    struct sockstune* tune;
+    const struct sockstune_profile* tune_listener;
+
+    /**
+     * destination health, see socks_server_set_breaker()
+     */
+    struct socksbreaker* breaker;
+
+    /**
+     * low-latency mode, see socks_server_set_lowlatency()
+     */
+    int cpu;
+    int busy_poll_usec;
+    int spin_usec;
+
+    /**
+     * loop wakeups served by spinning / by a blocking select
+     */
+    uint64_t spin_wakeups;
+    uint64_t sleep_wakeups;
+
+    /**
+     * fairness: longest a ready connection waited for its turn (usec),
+     * turns cut short by the per-round quota
+     */
+    uint64_t sched_max_wait_usec;
+    uint64_t sched_preemptions;
 } socks_server_t;
 
+typedef struct {
+    /**
+     * core the loop thread is pinned to and the listener prefers for
+     * incoming connections (SO_INCOMING_CPU), -1 for none
+     */
+    int cpu;
+
+    /**
+     * SO_BUSY_POLL for accepted and outbound sockets, 0 to disable
+     */
+    int busy_poll_usec;
+
+    /**
+     * time the loop polls without blocking before it goes to sleep
+     */
+    int spin_usec;
+} socks_server_lowlatency_t;
+
+/**
+ * socks_server_start_ex() flags
+ */
+#define SOCKS_SERVER_REUSEPORT 1
+
 int socks_server_start(socks_server_t * s, struct sockaddr * addr, socklen_t addr_len);
+int socks_server_start_ex(socks_server_t * s, struct sockaddr * addr, socklen_t addr_len, int flags);
+
+/**
+ * Enables low-latency mode, must be called from the thread running the
+ * server loop when cpu pinning is requested.
+ */
+int socks_server_set_lowlatency(socks_server_t * s, const socks_server_lowlatency_t * ll);
+
+/**
+ * Makes the listener accept TLS only; the certificate file may contain a
+ * chain. Requires a build with TLS=1. TLS tunnels are always relayed by
+ * the loop, never by the sockmap (the client leg's records are decrypted
+ * by OpenSSL, even with kTLS).
+ */
+int socks_server_set_tls(socks_server_t * s, const char* cert_file, const char* key_file);
+
+/**
+ * Lets the kernel encrypt the records of TLS connections accepted from
+ * now on, where the kernel has the tls module. Received records are still
+ * read through OpenSSL. Returns 0 without socks_server_set_tls().
+ */
+int socks_server_enable_ktls(socks_server_t * s);
+
+/**
+ * Relays established tunnels inside the kernel through a BPF sockmap.
+ * Returns 0 when the kernel or privileges do not allow it, tunnels are
+ * then relayed by the loop as before. Has no effect on TLS listeners.
+ */
+int socks_server_enable_sockmap(socks_server_t * s);
+
+/**
+ * Attaches a pre-connect pool (sockspool.h). Servers run by the same
+ * thread may share one; the caller frees it after socks_server_cleanup().
+ */
+void socks_server_set_pool(socks_server_t * s, struct sockspool* pool);
+
+/**
+ * Attaches a destination circuit breaker (socksbreaker.h): requests for
+ * hosts and addresses that keep failing are answered host unreachable
+ * without resolving or connecting. Servers run by the same thread may
+ * share one; the caller frees it after socks_server_cleanup().
+ */
+void socks_server_set_breaker(socks_server_t * s, struct socksbreaker* breaker);
+
+/**
+ * Requires username/password authentication (socksauth.h): RFC 1929 for
+ * SOCKS5, Basic for HTTP CONNECT; SOCKS4 is refused. The store may be
+ * shared by all servers and outlives them.
+ */
+void socks_server_set_auth(socks_server_t * s, struct socksauth* auth);
+
+/**
+ * Applies tuning profiles (sockstune.h) to the client and target sockets
+ * of every tunnel. The listener gets the named profile, or with NULL the
+ * one its port's listen rule names; source and destination rules take
+ * precedence. The rules may be shared by all servers and outlive them.
+ */
+int socks_server_set_tuning(socks_server_t * s, struct sockstune* tune, const char* profile);
+
+void socks_server_set_callbacks(socks_server_t * s, const socks_server_callbacks_t * callbacks);
+
+/**
+ * Embedding API. The returned epoll fd becomes readable whenever the
+ * server has work; the host loop watches it next to its own events and
+ * calls socks_server_process_events(), which never blocks. The server is
+ * then driven by these calls only, not by the select() based functions
+ * below. Returns -1 on failure.
+ */
+int socks_server_epoll_fd(socks_server_t * s);
+
+/**
+ * Milliseconds until the next internal deadline (timeouts), -1 when there
+ * is none. The host loop should call socks_server_process_events() no
+ * later than that even if the epoll fd stays quiet.
+ */
+int socks_server_next_timeout(socks_server_t * s);
+
+int socks_server_process_events(socks_server_t * s);
+
 int socks_server_periodic(socks_server_t * server, int wait_millis);
+
+/**
+ * Serves several servers with a single select() call.
+ */
+int socks_server_periodic_multi(socks_server_t ** servers, int n_servers, int wait_millis);
 void socks_server_periodic_select_prepare(socks_server_t * s, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, int* maxfd);
 int socks_server_periodic_process(socks_server_t * s, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, int* num);
 void socks_server_cleanup(socks_server_t * server);
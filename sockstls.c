@@ -0,0 +1,206 @@
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "sockstls.h"
+#include "sockslog.h"
+
+#ifdef SOCKS_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+struct sockstls_ctx {
+    SSL_CTX* ctx;
+};
+
+struct sockstls_conn {
+    SSL* ssl;
+};
+
+static void log_ssl_errors(const char* what) {
+    unsigned long e;
+    char buf[256];
+    
+    while ((e = ERR_get_error()) != 0) {
+        ERR_error_string_n(e, buf, sizeof(buf));
+        slogf_ratelimited(SLOG_INFO, "%s: %s\n", what, buf);
+    }
+}
+
+sockstls_ctx_t* sockstls_ctx_new(const char* cert_file, const char* key_file) {
+    sockstls_ctx_t* c = calloc(1, sizeof(sockstls_ctx_t));
+    
+    if (c == NULL || (c->ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+        goto fail;
+    }
+    
+    SSL_CTX_set_min_proto_version(c->ctx, TLS1_2_VERSION);
+    // non-application records must not make SSL_read block the event loop
+    SSL_CTX_clear_mode(c->ctx, SSL_MODE_AUTO_RETRY);
+    SSL_CTX_set_mode(c->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    
+    if (SSL_CTX_use_certificate_chain_file(c->ctx, cert_file) != 1
+            || SSL_CTX_use_PrivateKey_file(c->ctx, key_file, SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(c->ctx) != 1) {
+        goto fail;
+    }
+    
+    return c;
+    
+    fail:
+    
+    log_ssl_errors("TLS context");
+    sockstls_ctx_free(c);
+    
+    return NULL;
+}
+
+void sockstls_ctx_free(sockstls_ctx_t* c) {
+    if (c == NULL) {
+        return;
+    }
+    
+    SSL_CTX_free(c->ctx);
+    free(c);
+}
+
+int sockstls_ctx_enable_ktls(sockstls_ctx_t* c) {
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(c->ctx, SSL_OP_ENABLE_KTLS);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+sockstls_conn_t* sockstls_conn_new(sockstls_ctx_t* ctx, int fd) {
+    sockstls_conn_t* c = calloc(1, sizeof(sockstls_conn_t));
+    
+    if (c == NULL || (c->ssl = SSL_new(ctx->ctx)) == NULL || SSL_set_fd(c->ssl, fd) != 1) {
+        log_ssl_errors("TLS connection");
+        sockstls_conn_free(c);
+        return NULL;
+    }
+    
+    SSL_set_accept_state(c->ssl);
+    
+    return c;
+}
+
+void sockstls_conn_free(sockstls_conn_t* c) {
+    if (c == NULL) {
+        return;
+    }
+    
+    SSL_free(c->ssl);
+    free(c);
+}
+
+int sockstls_handshake(sockstls_conn_t* c) {
+    int r = SSL_do_handshake(c->ssl);
+    
+    if (r == 1) {
+        return SOCKSTLS_DONE;
+    }
+    
+    switch (SSL_get_error(c->ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+            return SOCKSTLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return SOCKSTLS_WANT_WRITE;
+    }
+    
+    log_ssl_errors("TLS handshake");
+    
+    return SOCKSTLS_FAIL;
+}
+
+int sockstls_ktls_send(sockstls_conn_t* c) {
+    return BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+}
+
+static ssize_t io_result(sockstls_conn_t* c, int r) {
+    switch (SSL_get_error(c->ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            return errno != 0 ? -1 : 0;
+    }
+    
+    log_ssl_errors("TLS");
+    errno = EPROTO;
+    
+    return -1;
+}
+
+ssize_t sockstls_recv(sockstls_conn_t* c, void* buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    
+    int r = SSL_read(c->ssl, buf, len);
+    
+    return r > 0 ? r : io_result(c, r);
+}
+
+ssize_t sockstls_send(sockstls_conn_t* c, const void* buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    
+    int r = SSL_write(c->ssl, buf, len);
+    
+    return r > 0 ? r : io_result(c, r);
+}
+
+int sockstls_pending(sockstls_conn_t* c) {
+    return SSL_pending(c->ssl);
+}
+
+#else
+
+sockstls_ctx_t* sockstls_ctx_new(const char* cert_file, const char* key_file) {
+    slogf(SLOG_ERROR, "built without TLS support (make TLS=1)\n");
+    return NULL;
+}
+
+void sockstls_ctx_free(sockstls_ctx_t* ctx) {
+}
+
+int sockstls_ctx_enable_ktls(sockstls_ctx_t* ctx) {
+    return 0;
+}
+
+sockstls_conn_t* sockstls_conn_new(sockstls_ctx_t* ctx, int fd) {
+    return NULL;
+}
+
+void sockstls_conn_free(sockstls_conn_t* conn) {
+}
+
+int sockstls_handshake(sockstls_conn_t* conn) {
+    return SOCKSTLS_FAIL;
+}
+
+int sockstls_ktls_send(sockstls_conn_t* conn) {
+    return 0;
+}
+
+ssize_t sockstls_recv(sockstls_conn_t* conn, void* buf, size_t len) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t sockstls_send(sockstls_conn_t* conn, const void* buf, size_t len) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int sockstls_pending(sockstls_conn_t* conn) {
+    return 0;
+}
+
+#endif
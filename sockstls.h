@@ -0,0 +1,74 @@
+/* 
+ * File:   sockstls.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * TLS for client connections through OpenSSL. With kernel TLS enabled on
+ * the context and the tls module loaded, the kernel takes over record
+ * encryption once the handshake completes and the socket can be sent to
+ * with plain send(); received records always go through sockstls_recv(),
+ * which also handles alerts and post-handshake messages. That keeps TLS
+ * tunnels out of the sockmap relay (socksbpf.h). Built without SOCKS_TLS
+ * every call fails and connections stay plaintext.
+ */
+
+#ifndef SOCKSTLS_H
+#define	SOCKSTLS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+struct sockstls_ctx;
+typedef struct sockstls_ctx sockstls_ctx_t;
+
+struct sockstls_conn;
+typedef struct sockstls_conn sockstls_conn_t;
+
+#define SOCKSTLS_DONE 1
+#define SOCKSTLS_WANT_READ 0
+#define SOCKSTLS_WANT_WRITE 2
+#define SOCKSTLS_FAIL -1
+
+sockstls_ctx_t* sockstls_ctx_new(const char* cert_file, const char* key_file);
+void sockstls_ctx_free(sockstls_ctx_t* ctx);
+
+/**
+ * Hands the record layer of connections created afterwards to the kernel
+ * (kTLS) where it supports it. Sends then bypass OpenSSL; OpenSSL keeps
+ * reading, receiving kernel-decrypted records with their record type.
+ * Returns 0 when this OpenSSL can't.
+ */
+int sockstls_ctx_enable_ktls(sockstls_ctx_t* ctx);
+
+/**
+ * fd must be non-blocking.
+ */
+sockstls_conn_t* sockstls_conn_new(sockstls_ctx_t* ctx, int fd);
+void sockstls_conn_free(sockstls_conn_t* conn);
+
+/**
+ * Advances the handshake, returns one of the SOCKSTLS_* states.
+ */
+int sockstls_handshake(sockstls_conn_t* conn);
+
+/**
+ * Whether the kernel took over encryption after the handshake.
+ */
+int sockstls_ktls_send(sockstls_conn_t* conn);
+
+/**
+ * recv()/send() semantics, -1 with errno EAGAIN when OpenSSL needs the
+ * socket to become readable / writable first.
+ */
+ssize_t sockstls_recv(sockstls_conn_t* conn, void* buf, size_t len);
+ssize_t sockstls_send(sockstls_conn_t* conn, const void* buf, size_t len);
+int sockstls_pending(sockstls_conn_t* conn);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSTLS_H */
+
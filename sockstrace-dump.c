@@ -0,0 +1,203 @@
+/* 
+ * File:   sockstrace-dump.c
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Merges sockstrace ring files and prints them as a timeline, or with -s
+ * as one line per connection with the time spent in each phase.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sockstrace.h"
+
+typedef struct {
+    sockstrace_record_t rec;
+    uint32_t tid;
+    uint32_t version;
+} entry_t;
+
+typedef struct {
+    uint32_t conn_id;
+    uint64_t accept, resolve_start, resolve_done, connect_start, connect_done, first_byte, close;
+    int64_t max_wait_us; // -1 when the ring does not record it
+} summary_t;
+
+static entry_t* entries = NULL;
+static size_t n_entries = 0;
+
+static int load_ring(const char* path) {
+    FILE* f = fopen(path, "rb");
+    sockstrace_ring_t hdr;
+    
+    if (f == NULL) {
+        perror(path);
+        return 0;
+    }
+    
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != SOCKSTRACE_MAGIC
+            || hdr.version < 1 || hdr.version > SOCKSTRACE_VERSION) {
+        fprintf(stderr, "%s: not a sockstrace ring\n", path);
+        fclose(f);
+        return 0;
+    }
+    
+    struct stat st;
+    
+    // the capacity masks record indexes, and the records must all be there
+    if (hdr.capacity == 0 || (hdr.capacity & (hdr.capacity - 1)) != 0 || fstat(fileno(f), &st) != 0
+            || (uint64_t)st.st_size != sizeof(hdr) + (uint64_t)hdr.capacity * sizeof(sockstrace_record_t)) {
+        fprintf(stderr, "%s: corrupt sockstrace ring\n", path);
+        fclose(f);
+        return 0;
+    }
+    
+    uint64_t first = hdr.head > hdr.capacity ? hdr.head - hdr.capacity : 0;
+    size_t n = hdr.head - first;
+    entry_t* grown = realloc(entries, (n_entries + n) * sizeof(entry_t));
+    
+    if (grown == NULL) {
+        perror("realloc");
+        fclose(f);
+        return 0;
+    }
+    entries = grown;
+    
+    for (uint64_t i = first; i < hdr.head; i++) {
+        entry_t* e = &entries[n_entries];
+        
+        if (fseek(f, sizeof(hdr) + (i & (hdr.capacity - 1)) * sizeof(sockstrace_record_t), SEEK_SET) != 0
+                || fread(&e->rec, sizeof(e->rec), 1, f) != 1) {
+            break;
+        }
+        e->tid = hdr.tid;
+        e->version = hdr.version;
+        n_entries++;
+    }
+    
+    fclose(f);
+    
+    return 1;
+}
+
+static int entry_cmp(const void* a, const void* b) {
+    const entry_t* ea = a;
+    const entry_t* eb = b;
+    
+    if (ea->rec.ts_ns != eb->rec.ts_ns) {
+        return ea->rec.ts_ns < eb->rec.ts_ns ? -1 : 1;
+    }
+    return 0;
+}
+
+static void print_timeline(void) {
+    uint64_t t0 = n_entries > 0 ? entries[0].rec.ts_ns : 0;
+    
+    printf("%12s %8s %8s %-14s %6s %s\n", "time_ms", "tid", "conn", "event", "stage", "arg");
+    
+    for (size_t i = 0; i < n_entries; i++) {
+        sockstrace_record_t* r = &entries[i].rec;
+        
+        printf("%12.3f %8u %8u %-14s %6d %lld\n", (r->ts_ns - t0) / 1e6, entries[i].tid, r->conn_id,
+                sockstrace_event_name(r->event), r->stage, (long long)r->arg);
+    }
+}
+
+static double span_ms(uint64_t from, uint64_t to) {
+    return from != 0 && to != 0 ? (to - from) / 1e6 : -1;
+}
+
+static void print_summary(void) {
+    summary_t* sums = NULL;
+    size_t n_sums = 0;
+    
+    for (size_t i = 0; i < n_entries; i++) {
+        sockstrace_record_t* r = &entries[i].rec;
+        summary_t* s = NULL;
+        
+        for (size_t j = n_sums; j > 0; j--) {
+            if (sums[j - 1].conn_id == r->conn_id) {
+                s = &sums[j - 1];
+                break;
+            }
+        }
+        
+        if (s == NULL || (r->event == SOCKSTRACE_EV_ACCEPT && s->accept != 0)) {
+            sums = realloc(sums, (n_sums + 1) * sizeof(summary_t));
+            s = &sums[n_sums++];
+            memset(s, 0, sizeof(summary_t));
+            s->conn_id = r->conn_id;
+        }
+        
+        switch (r->event) {
+            case SOCKSTRACE_EV_ACCEPT: s->accept = r->ts_ns; break;
+            case SOCKSTRACE_EV_RESOLVE_START: s->resolve_start = r->ts_ns; break;
+            case SOCKSTRACE_EV_RESOLVE_DONE: s->resolve_done = r->ts_ns; break;
+            case SOCKSTRACE_EV_CONNECT_START: s->connect_start = r->ts_ns; break;
+            case SOCKSTRACE_EV_CONNECT_DONE: s->connect_done = r->ts_ns; break;
+            case SOCKSTRACE_EV_FIRST_BYTE: s->first_byte = r->ts_ns; break;
+            case SOCKSTRACE_EV_CLOSE:
+                s->close = r->ts_ns;
+                s->max_wait_us = entries[i].version >= 2 ? r->arg : -1;
+                break;
+        }
+    }
+    
+    // -1 marks a phase that did not happen or fell out of the ring
+    printf("%8s %12s %12s %12s %12s %12s %12s\n", "conn", "request_ms", "resolve_ms", "connect_ms", "ttfb_ms", "lifetime_ms", "max_wait_ms");
+    
+    for (size_t i = 0; i < n_sums; i++) {
+        summary_t* s = &sums[i];
+        uint64_t request_done = s->resolve_start ? s->resolve_start : s->connect_start;
+        
+        printf("%8u %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n", s->conn_id,
+                span_ms(s->accept, request_done),
+                span_ms(s->resolve_start, s->resolve_done),
+                span_ms(s->connect_start, s->connect_done),
+                span_ms(s->accept, s->first_byte),
+                span_ms(s->accept, s->close),
+                s->close != 0 && s->max_wait_us >= 0 ? s->max_wait_us / 1e3 : -1.0);
+    }
+    
+    free(sums);
+}
+
+int main(int argc, char** argv) {
+    int summary = 0;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+            case 's':
+                summary = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s] ring-file...\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-s] ring-file...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    for (int i = optind; i < argc; i++) {
+        load_ring(argv[i]);
+    }
+    
+    qsort(entries, n_entries, sizeof(entry_t), entry_cmp);
+    
+    if (summary) {
+        print_summary();
+    } else {
+        print_timeline();
+    }
+    
+    free(entries);
+    
+    return EXIT_SUCCESS;
+}
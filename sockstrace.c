@@ -0,0 +1,136 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errorfc.h>
+
+#include "sockstrace.h"
+
+int sockstrace_enabled = 0;
+
+static char trace_prefix[256];
+static uint32_t trace_capacity = SOCKSTRACE_DEF_CAPACITY;
+
+static __thread sockstrace_ring_t* ring = NULL;
+static __thread int ring_failed = 0;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static size_t ring_size(uint32_t capacity) {
+    return sizeof(sockstrace_ring_t) + (size_t)capacity * sizeof(sockstrace_record_t);
+}
+
+static void ring_release(void* ptr) {
+    sockstrace_ring_t* r = ptr;
+    
+    WARN_IFM1(munmap(r, ring_size(r->capacity)));
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static sockstrace_ring_t* ring_create(void) {
+    char path[sizeof(trace_prefix) + 16];
+    int fd = -1;
+    size_t size = ring_size(trace_capacity);
+    pid_t tid = syscall(SYS_gettid);
+    sockstrace_ring_t* r;
+    
+    snprintf(path, sizeof(path), "%s.%d", trace_prefix, (int)tid);
+    
+    WARNFAIL_IFM1(fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    WARNFAIL_IFNZ(ftruncate(fd, size));
+    
+    r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (r == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+    
+    WARN_IFM1(close(fd));
+    
+    r->magic = SOCKSTRACE_MAGIC;
+    r->version = SOCKSTRACE_VERSION;
+    r->capacity = trace_capacity;
+    r->tid = tid;
+    r->head = 0;
+    
+    pthread_once(&ring_key_once, ring_key_create);
+    pthread_setspecific(ring_key, r);
+    
+    return r;
+    
+    CATCH;
+    
+    if (fd != -1) {
+        WARN_IFM1(close(fd));
+    }
+    
+    return NULL;
+}
+
+int sockstrace_open(const char* path_prefix, uint32_t capacity) {
+    if (strlen(path_prefix) >= sizeof(trace_prefix)) {
+        return 0;
+    }
+    
+    strcpy(trace_prefix, path_prefix);
+    
+    trace_capacity = 1;
+    while (trace_capacity < (capacity ? capacity : SOCKSTRACE_DEF_CAPACITY)) {
+        trace_capacity <<= 1;
+    }
+    
+    sockstrace_enabled = 1;
+    
+    return 1;
+}
+
+void sockstrace_emit(uint32_t conn_id, int event, int stage, int64_t arg) {
+    if (ring == NULL) {
+        if (ring_failed || (ring = ring_create()) == NULL) {
+            ring_failed = 1;
+            return;
+        }
+    }
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    uint64_t head = ring->head;
+    sockstrace_record_t* rec = (sockstrace_record_t*)(ring + 1) + (head & (ring->capacity - 1));
+    
+    rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->conn_id = conn_id;
+    rec->event = event;
+    rec->stage = stage;
+    rec->arg = arg;
+    
+    // publish after the record body, readers of a live ring rely on it
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+const char* sockstrace_event_name(int event) {
+    switch (event) {
+        case SOCKSTRACE_EV_ACCEPT: return "accept";
+        case SOCKSTRACE_EV_STAGE: return "stage";
+        case SOCKSTRACE_EV_RESOLVE_START: return "resolve_start";
+        case SOCKSTRACE_EV_RESOLVE_DONE: return "resolve_done";
+        case SOCKSTRACE_EV_CONNECT_START: return "connect_start";
+        case SOCKSTRACE_EV_CONNECT_DONE: return "connect_done";
+        case SOCKSTRACE_EV_FIRST_BYTE: return "first_byte";
+        case SOCKSTRACE_EV_CLOSE: return "close";
+    }
+    return "unknown";
+}
@@ -0,0 +1,92 @@
+/* 
+ * File:   sockstrace.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Connection lifecycle tracepoints. Every tracepoint is exported as a USDT
+ * probe (provider "simplesocks") when built with -DSOCKS_USDT, and is
+ * recorded into a per-thread binary ring buffer when sockstrace_open() was
+ * called. Ring files are read by sockstrace-dump.
+ */
+
+#ifndef SOCKSTRACE_H
+#define	SOCKSTRACE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#ifdef SOCKS_USDT
+#include <sys/sdt.h>
+#define SOCKSTRACE_PROBE(name, id, stage, arg) DTRACE_PROBE3(simplesocks, name, id, stage, arg)
+#else
+#define SOCKSTRACE_PROBE(name, id, stage, arg)
+#endif
+
+#define SOCKSTRACE_MAGIC 0x52545353 /* "SSTR" */
+/**
+ * 2: the CLOSE argument carries the longest relay wait (0 before)
+ */
+#define SOCKSTRACE_VERSION 2
+
+#define SOCKSTRACE_DEF_CAPACITY 65536
+
+#define SOCKSTRACE_EV_ACCEPT 1
+#define SOCKSTRACE_EV_STAGE 2
+#define SOCKSTRACE_EV_RESOLVE_START 3
+#define SOCKSTRACE_EV_RESOLVE_DONE 4
+#define SOCKSTRACE_EV_CONNECT_START 5
+#define SOCKSTRACE_EV_CONNECT_DONE 6
+#define SOCKSTRACE_EV_FIRST_BYTE 7
+#define SOCKSTRACE_EV_CLOSE 8
+
+typedef struct {
+    /**
+     * CLOCK_MONOTONIC nanoseconds
+     */
+    uint64_t ts_ns;
+    uint32_t conn_id;
+    uint16_t event;
+    int16_t stage;
+    /**
+     * event specific: fd, error code, byte count; for CLOSE the longest
+     * the connection waited for its relay turn (usec)
+     */
+    int64_t arg;
+} sockstrace_record_t;
+
+/**
+ * Ring file layout: this header followed by capacity records. Only the
+ * owning thread writes; head counts all records ever written, so the
+ * oldest valid record is at max(0, head - capacity).
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t tid;
+    uint64_t head;
+} sockstrace_ring_t;
+
+extern int sockstrace_enabled;
+
+/**
+ * Enables ring recording; each thread writes to "<path_prefix>.<tid>".
+ * capacity is rounded up to a power of two, 0 selects the default.
+ */
+int sockstrace_open(const char* path_prefix, uint32_t capacity);
+void sockstrace_emit(uint32_t conn_id, int event, int stage, int64_t arg);
+const char* sockstrace_event_name(int event);
+
+#define sockstrace(name, EV, id, stage, arg) do { \
+    SOCKSTRACE_PROBE(name, id, stage, arg); \
+    if (sockstrace_enabled) { sockstrace_emit((id), SOCKSTRACE_EV_##EV, (stage), (arg)); } \
+} while (0)
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSTRACE_H */
+
@@ -0,0 +1,414 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "sockstune.h"
+#include "sockslog.h"
+
+#define TUNE_MAX_PROFILES 32
+#define TUNE_MAX_RULES 256
+#define TUNE_LINE_MAX 512
+
+#define RULE_LISTEN 1
+#define RULE_SOURCE 2
+#define RULE_DEST 3
+
+typedef struct {
+    int kind;
+    
+    /**
+     * address rules: family, network in the first prefix bits
+     */
+    int family;
+    uint8_t net[16];
+    int prefix;
+    
+    int port;
+    
+    const sockstune_profile_t* profile;
+} tune_rule_t;
+
+struct sockstune {
+    sockstune_profile_t profiles[TUNE_MAX_PROFILES];
+    int n_profiles;
+    
+    tune_rule_t rules[TUNE_MAX_RULES];
+    int n_rules;
+};
+
+const sockstune_profile_t* sockstune_profile(sockstune_t* t, const char* name) {
+    for (int i = 0; i < t->n_profiles; i++) {
+        if (strcmp(t->profiles[i].name, name) == 0) {
+            return &t->profiles[i];
+        }
+    }
+    
+    return NULL;
+}
+
+#define TUNE_SIZE_MAX (1024L * 1024 * 1024)
+
+/**
+ * Byte count with an optional k / m / g suffix, at most TUNE_SIZE_MAX.
+ */
+static int parse_size(const char* v, int* out) {
+    char* end;
+    long mult = 1;
+    long n;
+    
+    errno = 0;
+    n = strtol(v, &end, 10);
+    
+    if (end == v || n < 0 || errno != 0) {
+        return 0;
+    }
+    
+    if (*end == 'k' || *end == 'K') {
+        mult = 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        mult = 1024 * 1024;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        mult = 1024 * 1024 * 1024;
+        end++;
+    }
+    
+    if (*end != 0 || n > TUNE_SIZE_MAX / mult) {
+        return 0;
+    }
+    
+    *out = n * mult;
+    
+    return 1;
+}
+
+static int parse_profile(sockstune_t* t, char* args) {
+    char* save;
+    char* name = strtok_r(args, " \t", &save);
+    
+    if (name == NULL || strlen(name) >= SOCKSTUNE_NAME_MAX || t->n_profiles == TUNE_MAX_PROFILES
+            || sockstune_profile(t, name) != NULL) {
+        return 0;
+    }
+    
+    sockstune_profile_t* p = &t->profiles[t->n_profiles];
+    
+    memset(p, 0, sizeof(*p));
+    strcpy(p->name, name);
+    p->nodelay = -1;
+    
+    for (char* opt = strtok_r(NULL, " \t", &save); opt != NULL; opt = strtok_r(NULL, " \t", &save)) {
+        char* v = strchr(opt, '=');
+    
+        if (v != NULL) {
+            *v++ = 0;
+        }
+    
+        if (strcmp(opt, "nodelay") == 0 && v == NULL) {
+            p->nodelay = 1;
+        } else if (strcmp(opt, "delay") == 0 && v == NULL) {
+            p->nodelay = 0;
+        } else if (strcmp(opt, "keepalive") == 0 && v != NULL) {
+            if (sscanf(v, "%d,%d,%d", &p->keepalive_idle, &p->keepalive_intvl, &p->keepalive_cnt) != 3
+                    || p->keepalive_idle <= 0 || p->keepalive_intvl <= 0 || p->keepalive_cnt <= 0) {
+                return 0;
+            }
+        } else if (strcmp(opt, "sndbuf") == 0 && v != NULL) {
+            if (!parse_size(v, &p->sndbuf)) {
+                return 0;
+            }
+        } else if (strcmp(opt, "rcvbuf") == 0 && v != NULL) {
+            if (!parse_size(v, &p->rcvbuf)) {
+                return 0;
+            }
+        } else if (strcmp(opt, "cc") == 0 && v != NULL && *v != 0 && strlen(v) < SOCKSTUNE_CC_MAX) {
+            strcpy(p->congestion, v);
+        } else {
+            return 0;
+        }
+    }
+    
+    t->n_profiles++;
+    
+    return 1;
+}
+
+static int parse_cidr(tune_rule_t* r, char* cidr) {
+    char* slash = strchr(cidr, '/');
+    int max;
+    
+    if (slash != NULL) {
+        *slash = 0;
+    }
+    
+    if (inet_pton(AF_INET, cidr, r->net) == 1) {
+        r->family = AF_INET;
+        max = 32;
+    } else if (inet_pton(AF_INET6, cidr, r->net) == 1) {
+        r->family = AF_INET6;
+        max = 128;
+    } else {
+        return 0;
+    }
+    
+    r->prefix = max;
+    
+    if (slash != NULL) {
+        char* end;
+    
+        r->prefix = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != 0 || r->prefix < 0 || r->prefix > max) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/**
+ * Port number 1..65535, nothing else on the word.
+ */
+static int parse_port(const char* v, int* out) {
+    char* end;
+    long n;
+    
+    errno = 0;
+    n = strtol(v, &end, 10);
+    
+    if (end == v || *end != 0 || errno != 0 || n < 1 || n > 65535) {
+        return 0;
+    }
+    
+    *out = n;
+    
+    return 1;
+}
+
+/**
+ * listen <port> <profile>
+ * source <cidr> <profile>
+ * dest <cidr> [port] <profile>
+ */
+static int parse_rule(sockstune_t* t, int kind, char* args) {
+    char* save;
+    char* words[3];
+    int n = 0;
+    
+    for (char* w = strtok_r(args, " \t", &save); w != NULL; w = strtok_r(NULL, " \t", &save)) {
+        if (n == 3) {
+            return 0;
+        }
+        words[n++] = w;
+    }
+    
+    if (n < 2 || (n == 3 && kind != RULE_DEST) || t->n_rules == TUNE_MAX_RULES) {
+        return 0;
+    }
+    
+    tune_rule_t* r = &t->rules[t->n_rules];
+    
+    memset(r, 0, sizeof(*r));
+    r->kind = kind;
+    
+    if ((r->profile = sockstune_profile(t, words[n - 1])) == NULL) {
+        return 0;
+    }
+    
+    // a mistyped port must not turn into 0, which matches any port
+    if (kind == RULE_LISTEN) {
+        if (!parse_port(words[0], &r->port)) {
+            return 0;
+        }
+    } else if (!parse_cidr(r, words[0])) {
+        return 0;
+    }
+    
+    if (n == 3 && !parse_port(words[1], &r->port)) {
+        return 0;
+    }
+    
+    t->n_rules++;
+    
+    return 1;
+}
+
+sockstune_t* sockstune_open(const char* path) {
+    FILE* f = fopen(path, "r");
+    sockstune_t* t = NULL;
+    char line[TUNE_LINE_MAX];
+    int lineno = 0;
+    
+    if (f == NULL) {
+        slogf(SLOG_ERROR, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    
+    if ((t = calloc(1, sizeof(sockstune_t))) == NULL) {
+        goto fail;
+    }
+    
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* args;
+        int ok;
+    
+        lineno++;
+        line[strcspn(line, "#\r\n")] = 0;
+    
+        char* kw = line + strspn(line, " \t");
+    
+        if (*kw == 0) {
+            continue;
+        }
+    
+        args = kw + strcspn(kw, " \t");
+        if (*args != 0) {
+            *args++ = 0;
+        }
+    
+        if (strcmp(kw, "profile") == 0) {
+            ok = parse_profile(t, args);
+        } else if (strcmp(kw, "listen") == 0) {
+            ok = parse_rule(t, RULE_LISTEN, args);
+        } else if (strcmp(kw, "source") == 0) {
+            ok = parse_rule(t, RULE_SOURCE, args);
+        } else if (strcmp(kw, "dest") == 0) {
+            ok = parse_rule(t, RULE_DEST, args);
+        } else {
+            ok = 0;
+        }
+    
+        if (!ok) {
+            slogf(SLOG_ERROR, "%s:%d: bad %s line\n", path, lineno, kw);
+            goto fail;
+        }
+    }
+    
+    fclose(f);
+    
+    return t;
+    
+    fail:
+    
+    fclose(f);
+    free(t);
+    
+    return NULL;
+}
+
+void sockstune_close(sockstune_t* t) {
+    free(t);
+}
+
+static int prefix_match(const uint8_t* a, const uint8_t* net, int prefix) {
+    int bytes = prefix / 8;
+    int bits = prefix % 8;
+    
+    if (memcmp(a, net, bytes) != 0) {
+        return 0;
+    }
+    
+    return bits == 0 || ((a[bytes] ^ net[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+static const sockstune_profile_t* match_addr(sockstune_t* t, int kind, const struct sockaddr* addr) {
+    const uint8_t* a;
+    int family = addr->sa_family;
+    int port;
+    
+    if (family == AF_INET) {
+        const struct sockaddr_in* a4 = (const struct sockaddr_in*)addr;
+    
+        a = (const uint8_t*)&a4->sin_addr;
+        port = ntohs(a4->sin_port);
+    } else if (family == AF_INET6) {
+        const struct sockaddr_in6* a6 = (const struct sockaddr_in6*)addr;
+    
+        a = (const uint8_t*)&a6->sin6_addr;
+        port = ntohs(a6->sin6_port);
+    
+        // IPv4 peers of a dual stack socket match the IPv4 rules
+        if (IN6_IS_ADDR_V4MAPPED(&a6->sin6_addr)) {
+            family = AF_INET;
+            a += 12;
+        }
+    } else {
+        return NULL;
+    }
+    
+    for (int i = 0; i < t->n_rules; i++) {
+        tune_rule_t* r = &t->rules[i];
+    
+        if (r->kind == kind && r->family == family && (r->port == 0 || r->port == port) && prefix_match(a, r->net, r->prefix)) {
+            return r->profile;
+        }
+    }
+    
+    return NULL;
+}
+
+const sockstune_profile_t* sockstune_match_listener(sockstune_t* t, int port) {
+    for (int i = 0; i < t->n_rules; i++) {
+        if (t->rules[i].kind == RULE_LISTEN && t->rules[i].port == port) {
+            return t->rules[i].profile;
+        }
+    }
+    
+    return NULL;
+}
+
+const sockstune_profile_t* sockstune_match_source(sockstune_t* t, const struct sockaddr* addr) {
+    return match_addr(t, RULE_SOURCE, addr);
+}
+
+const sockstune_profile_t* sockstune_match_dest(sockstune_t* t, const struct sockaddr* addr) {
+    return match_addr(t, RULE_DEST, addr);
+}
+
+static int set_int(int sock, int level, int opt, int val, const char* opt_name, const sockstune_profile_t* p) {
+    if (setsockopt(sock, level, opt, &val, sizeof(val)) == -1) {
+        slogf_ratelimited(SLOG_WARN, "profile %s: %s: %s\n", p->name, opt_name, strerror(errno));
+        return 0;
+    }
+    
+    return 1;
+}
+
+int sockstune_apply(const sockstune_profile_t* p, int sock) {
+    int ok = 1;
+    
+    if (p->nodelay != -1) {
+        ok &= set_int(sock, IPPROTO_TCP, TCP_NODELAY, p->nodelay, "TCP_NODELAY", p);
+    }
+    
+    if (p->keepalive_idle > 0) {
+        ok &= set_int(sock, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE", p);
+        ok &= set_int(sock, IPPROTO_TCP, TCP_KEEPIDLE, p->keepalive_idle, "TCP_KEEPIDLE", p);
+        ok &= set_int(sock, IPPROTO_TCP, TCP_KEEPINTVL, p->keepalive_intvl, "TCP_KEEPINTVL", p);
+        ok &= set_int(sock, IPPROTO_TCP, TCP_KEEPCNT, p->keepalive_cnt, "TCP_KEEPCNT", p);
+    }
+    
+    // the kernel doubles the value and caps it at net.core.[wr]mem_max
+    if (p->sndbuf > 0) {
+        ok &= set_int(sock, SOL_SOCKET, SO_SNDBUF, p->sndbuf, "SO_SNDBUF", p);
+    }
+    if (p->rcvbuf > 0) {
+        ok &= set_int(sock, SOL_SOCKET, SO_RCVBUF, p->rcvbuf, "SO_RCVBUF", p);
+    }
+    
+#ifdef TCP_CONGESTION
+    if (p->congestion[0] != 0 && setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, p->congestion, strlen(p->congestion)) == -1) {
+        slogf_ratelimited(SLOG_WARN, "profile %s: TCP_CONGESTION %s: %s\n", p->name, p->congestion, strerror(errno));
+        ok = 0;
+    }
+#endif
+    
+    return ok;
+}
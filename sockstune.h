@@ -0,0 +1,94 @@
+/* 
+ * File:   sockstune.h
+ * Author: Nuke Sparrow <nukesparrow@bitmessage.ch>
+ *
+ * Socket tuning profiles. A tuning file defines named sets of TCP socket
+ * options and rules choosing one by listener port, client source range or
+ * destination; the server applies the chosen profile to both legs of a
+ * tunnel. Immutable once loaded, one instance can serve all threads.
+ *
+ *   # comment
+ *   profile interactive nodelay keepalive=60,10,5
+ *   profile bulk sndbuf=4m rcvbuf=4m cc=bbr
+ *   listen 1081 bulk
+ *   source 10.0.0.0/8 interactive
+ *   dest 0.0.0.0/0 22 interactive
+ *   dest 2001:db8::/32 bulk
+ *
+ * A destination rule beats a source rule, which beats a listen rule;
+ * within a kind the first matching line wins. A profile only changes the
+ * options it names, the others keep what the socket had.
+ */
+
+#ifndef SOCKSTUNE_H
+#define	SOCKSTUNE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <sys/socket.h>
+
+#define SOCKSTUNE_NAME_MAX 32
+#define SOCKSTUNE_CC_MAX 16
+
+struct sockstune;
+typedef struct sockstune sockstune_t;
+
+typedef struct sockstune_profile {
+    char name[SOCKSTUNE_NAME_MAX];
+
+    /**
+     * TCP_NODELAY: 1 on, 0 off, -1 kernel default
+     */
+    int nodelay;
+
+    /**
+     * SO_KEEPALIVE with TCP_KEEPIDLE / TCP_KEEPINTVL / TCP_KEEPCNT when
+     * keepalive_idle is positive, 0 keeps the kernel default
+     */
+    int keepalive_idle;
+    int keepalive_intvl;
+    int keepalive_cnt;
+
+    /**
+     * SO_SNDBUF / SO_RCVBUF in bytes (k / m / g suffixes in the file, at
+     * most 1g), 0 leaves buffer autotuning on
+     */
+    int sndbuf;
+    int rcvbuf;
+
+    /**
+     * TCP_CONGESTION algorithm, empty for the system default
+     */
+    char congestion[SOCKSTUNE_CC_MAX];
+} sockstune_profile_t;
+
+sockstune_t* sockstune_open(const char* path);
+void sockstune_close(sockstune_t* t);
+
+/**
+ * Profile by name, NULL when undefined.
+ */
+const sockstune_profile_t* sockstune_profile(sockstune_t* t, const char* name);
+
+/**
+ * Profile of the first rule of the kind matching, NULL for none. Port 0
+ * matches any port.
+ */
+const sockstune_profile_t* sockstune_match_listener(sockstune_t* t, int port);
+const sockstune_profile_t* sockstune_match_source(sockstune_t* t, const struct sockaddr* addr);
+const sockstune_profile_t* sockstune_match_dest(sockstune_t* t, const struct sockaddr* addr);
+
+/**
+ * Sets the profile's options on a TCP socket. Options the kernel refuses
+ * are logged and skipped, returns 0 when any was.
+ */
+int sockstune_apply(const sockstune_profile_t* p, int sock);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SOCKSTUNE_H */
+